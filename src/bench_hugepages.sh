@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Replays a trace with every backend in competition mode, once per page
+# pool backing (normal pages, transparent huge pages, explicit huge
+# pages), and reports the best time out of RUNS runs together with the
+# backing that actually took effect. If perf is installed the dTLB load
+# misses of the best run are reported as well.
+#
+# usage: bench_hugepages.sh [trace] [backends...]
+
+TRACE=${1:-testsuite/5.trace}
+shift
+BACKENDS=${@:-"KMA_P2FL KMA_BUD KMA_RM"}
+MODES="none thp hugetlb"
+RUNS=${RUNS:-3}
+
+CC=gcc
+CFLAGS="-g -Wall -O2 -pthread -D HAVE_CONFIG_H"
+SRCS="kma.c kma_page.c kma_dummy.c kma_rm.c kma_p2fl.c kma_mck2.c kma_bud.c kma_lzbud.c kma_slab.c kma_tlsf.c kma_gbud.c kma_bmap.c kma_span.c"
+
+TMP=`mktemp -d /tmp/kma.bench.XXXXXX`;
+
+function cleanUp()
+{
+	rm -Rf ${TMP};
+}
+
+PERF=""
+if perf stat -e dTLB-load-misses true > /dev/null 2>&1; then
+	PERF="perf stat -x, -e dTLB-load-misses -o ${TMP}/perf.out";
+fi;
+
+echo "Replaying ${TRACE}";
+printf "%-10s %-8s %-8s %10s %16s\n" "backend" "mode" "backing" "time (s)" "dTLB misses";
+
+for b in ${BACKENDS}; do
+	${CC} ${CFLAGS} -DCOMPETITION -D${b} -o ${TMP}/${b} ${SRCS} || { cleanUp; exit 1; }
+
+	for m in ${MODES}; do
+		BEST=""
+		MISSES="n/a"
+		for i in `seq ${RUNS}`; do
+			START=`date +%s%N`;
+			KMA_HUGEPAGES=${m} ${PERF} ${TMP}/${b} ${TRACE} > ${TMP}/out 2>&1;
+			END=`date +%s%N`;
+
+			if [[ `grep -c "Test: PASS" ${TMP}/out` -eq 0 ]]; then
+				echo "${b} failed with KMA_HUGEPAGES=${m}. Tail of output follows";
+				tail ${TMP}/out;
+				cleanUp;
+				exit 1;
+			fi;
+
+			ELAPSED=$(( (END - START) / 1000 ));
+			if [[ -z "${BEST}" || ${ELAPSED} -lt ${BEST} ]]; then
+				BEST=${ELAPSED};
+				if [[ -n "${PERF}" ]]; then
+					MISSES=`grep dTLB-load-misses ${TMP}/perf.out | cut -d, -f1`;
+				fi;
+			fi;
+		done;
+
+		BACKING=`grep "Page Pool Backing" ${TMP}/out | awk '{ print $4 }'`;
+		printf "%-10s %-8s %-8s %10d.%06d %16s\n" ${b} ${m} ${BACKING:-none} \
+			$(( BEST / 1000000 )) $(( BEST % 1000000 )) "${MISSES}";
+	done;
+done;
+
+cleanUp;
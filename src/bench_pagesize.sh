@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# Builds the competition binary of every backend once per page size
+# (-DPAGESIZE) and replays a trace with each, reporting the average
+# waste ratio, the best time out of RUNS runs, the pages requested from
+# the page layer and the requests refused for being larger than a page.
+#
+# usage: bench_pagesize.sh [trace] [backends...]
+
+TRACE=${1:-testsuite/5.trace}
+shift
+BACKENDS=${@:-"KMA_P2FL KMA_BUD KMA_RM"}
+PAGESIZES=${PAGESIZES:-"4096 8192 16384 65536"}
+RUNS=${RUNS:-1}
+
+CC=gcc
+CFLAGS="-g -Wall -O2 -pthread -D HAVE_CONFIG_H"
+SRCS="kma.c kma_page.c kma_dummy.c kma_rm.c kma_p2fl.c kma_mck2.c kma_bud.c kma_lzbud.c kma_slab.c kma_tlsf.c kma_gbud.c kma_bmap.c kma_span.c"
+
+TMP=`mktemp -d /tmp/kma.bench.XXXXXX`;
+
+function cleanUp()
+{
+	rm -Rf ${TMP};
+}
+
+echo "Replaying ${TRACE}";
+printf "%-10s %9s %10s %10s %10s %9s\n" "backend" "page size" "ratio" "time (s)" "pages" "refused";
+
+for b in ${BACKENDS}; do
+	for s in ${PAGESIZES}; do
+		${CC} ${CFLAGS} -DCOMPETITION -D${b} -DPAGESIZE=${s} -o ${TMP}/${b}.${s} ${SRCS} || { cleanUp; exit 1; }
+
+		BEST=""
+		for i in `seq ${RUNS}`; do
+			START=`date +%s%N`;
+			${TMP}/${b}.${s} ${TRACE} > ${TMP}/out 2>&1;
+			END=`date +%s%N`;
+
+			ELAPSED=$(( (END - START) / 1000 ));
+			if [[ -z "${BEST}" || ${ELAPSED} -lt ${BEST} ]]; then
+				BEST=${ELAPSED};
+			fi;
+		done;
+
+		if [[ `grep -c "Test: PASS" ${TMP}/out` -eq 0 ]]; then
+			printf "%-10s %9d %10s\n" ${b} ${s} "FAILED";
+			continue;
+		fi;
+
+		RATIO=`grep "Competition average ratio" ${TMP}/out | awk '{ print $4 }'`;
+		PAGES=`grep "Page Requested" ${TMP}/out | awk -F'[:/]' '{ print $4 + 0 }'`;
+		REFUSED=`grep "Refused Requests" ${TMP}/out | awk '{ print $3 }'`;
+		printf "%-10s %9d %10s %3d.%06d %10s %9s\n" ${b} ${s} ${RATIO} \
+			$(( BEST / 1000000 )) $(( BEST % 1000000 )) ${PAGES} ${REFUSED:-0};
+	done;
+done;
+
+cleanUp;
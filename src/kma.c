@@ -100,6 +100,9 @@ int anyMismatches = 0;
 
 int currentAllocBytes = 0;
 
+// requests too large for a page that the algorithm refused
+int refusedRequests = 0;
+
 char *name = NULL;
 
 int
@@ -215,9 +218,47 @@ main(int argc, char* argv[])
   
   stat = page_stats();
   
+  printf("Page Size: %d\n", stat->page_size);
+  
+  if (refusedRequests > 0)
+    {
+      printf("Refused Requests: %d\n", refusedRequests);
+    }
+  
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
   
+  if (stat->huge_mode != HUGE_NONE)
+    {
+      printf("Page Pool Backing: %s\n",
+	     stat->huge_mode == HUGE_HUGETLB ? "hugetlb" : "thp");
+    }
+  
+  if (stat->num_cache_hits + stat->num_cache_misses > 0)
+    {
+      printf("Page Cache Hit Rate: %.1f%%\n", 100.0 * stat->num_cache_hits
+	     / (stat->num_cache_hits + stat->num_cache_misses));
+    }
+  
+  if (stat->num_scavenged > 0)
+    {
+      printf("Page Resident/Committed: %5d/%5d (%d scavenged)\n",
+	     stat->num_resident, stat->num_committed, stat->num_scavenged);
+    }
+  
+  if (stat->num_runs_requested > 0)
+    {
+      printf("Page Runs Requested/Freed/In Use: %5d/%5d/%5d\n",
+	     stat->num_runs_requested, stat->num_runs_freed,
+	     stat->num_runs_in_use);
+    }
+  
+#if defined(KMA_BUD) || defined(KMA_LZBUD) || defined(KMA_GBUD)
+  printf("Buddy Splits/Merges/Lazy Frees: %d/%d/%d\n",
+	 buddy_stats()->num_splits, buddy_stats()->num_merges,
+	 buddy_stats()->num_lazy_frees);
+#endif
+  
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
       error("not all pages freed", "");
@@ -272,15 +313,16 @@ allocate(mem_t* requests, int req_id, int req_size)
   new->size = req_size;
   new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  // Accept a NULL response in some cases... requests that do not
+  // fit into a single page may be served from a run of pages
+  if((new->ptr == NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
   
   if (new->ptr == NULL)
     {
+      refusedRequests++;
       return;
     }
 
@@ -311,6 +353,12 @@ deallocate(mem_t* requests, int req_id)
 {
   mem_t* cur = &requests[req_id];
   
+  if (cur->state == FREE && cur->ptr == NULL)
+    {
+      // the allocator refused this (oversized) request
+      return;
+    }
+  
   assert(cur->state == USED);
   assert(cur->size > 0);
   
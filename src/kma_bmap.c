@@ -0,0 +1,573 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on per-page slot bitmaps
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the bitmap allocator
+ *
+ ***************************************************************************/
+#ifdef KMA_BMAP
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// a page is cut into slots of one size; class c has slots of
+// 16 * 8^c bytes, and a request takes a run of up to MAXRUN contiguous
+// slots of the smallest class where that is enough
+#define NUMBERCLASS 3
+#define MINSLOTLOG2 4
+#define SLOTLOG2(class) (MINSLOTLOG2 + 3 * (class))
+#define MAXRUN 64
+
+// bitmap words of a page of the smallest slots
+#define MAXWORDS (PAGESIZE >> MINSLOTLOG2 >> 6)
+
+#define SLOTS(class) (PAGESIZE >> SLOTLOG2(class))
+#define WORDS(class) ((SLOTS(class) + 63) / 64)
+
+// what is known of a page, kept off the page in a table by page number:
+// a bit per slot, set while the slot is allocated (and for the bits past
+// the last slot), the slots in use and the longest run of free slots, up
+// to MAXRUN. Pages with free slots are on the list of their class and
+// longest run, linked by page number (-1 ends a list).
+typedef struct
+{
+  uint64_t map[MAXWORDS];
+  int used;
+  int8_t class;
+  uint8_t longest;
+  int next;
+  int prev;
+} page_info_t;
+
+// a table page of page_info_t and the pages in use it describes; it is
+// taken with the first of them and given back with the last
+typedef struct
+{
+  page_info_t* infos;
+  int pages;
+} info_dir_t;
+
+#define INFOPERPAGE (PAGESIZE / sizeof(page_info_t))
+#define INFO(id) (&info_dir[(id) / INFOPERPAGE].infos[(id) % INFOPERPAGE])
+
+/************Global Variables*********************************************/
+
+// the directory of the table pages, in a run of its own that grows with
+// the page numbers in use
+static kma_page_t* info_dir_run = NULL;
+static info_dir_t* info_dir;
+static int info_entries;
+
+// the address of page number 0 of the pool
+static void* pool_base = NULL;
+
+// per class and longest run the first page, and a bit per run length
+// (bit n - 1 for n) whose list is not empty
+static int bin_head[NUMBERCLASS][MAXRUN + 1];
+static uint64_t bin_mask[NUMBERCLASS];
+
+static int pages_in_use = 0;
+
+//empty pages kept for reuse instead of being released
+static kma_page_t* spare_pages[SPAREPAGES];
+static int spare_count = 0;
+
+/************Function Prototypes******************************************/
+int classOf(kma_size_t);
+int newPage(int);
+page_info_t* newInfo(int);
+void growInfoDir(int);
+void releasePage(int);
+void linkPage(int);
+void unlinkPage(int);
+void updateLongest(int);
+uint64_t notFullWords(const uint64_t*, int);
+int findRun(const uint64_t*, int, int);
+int longestRun(const uint64_t*, int);
+void markRun(uint64_t*, int, int, bool);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page;
+  page_info_t* info;
+  uint64_t bins;
+  int class, n, id, slot;
+
+  if (size > PAGESIZE)
+    {
+      // a run of pages of its own
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return page == NULL ? NULL : page->ptr;
+    }
+
+  class = classOf(size);
+  n = (size + (1 << SLOTLOG2(class)) - 1) >> SLOTLOG2(class);
+  if (n == 0)
+    {
+      n = 1;
+    }
+
+  // the page with the shortest longest run that is long enough
+  bins = bin_mask[class] & (~0ULL << (n - 1));
+  if (bins == 0)
+    {
+      id = newPage(class);
+    }
+  else
+    {
+      id = bin_head[class][__builtin_ctzll(bins) + 1];
+    }
+  info = INFO(id);
+
+  slot = findRun(info->map, WORDS(class), n);
+  assert(slot >= 0);
+  markRun(info->map, slot, n, TRUE);
+  info->used += n;
+  updateLongest(id);
+
+  return pool_base + (long) id * PAGESIZE + ((long) slot << SLOTLOG2(class));
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  page_info_t* info;
+  int class, n, id;
+
+  if (size > PAGESIZE)
+    {
+      free_pages(kma_page_from_addr(ptr));
+      return;
+    }
+
+  id = (BASEADDR(ptr) - pool_base) / PAGESIZE;
+  info = INFO(id);
+  class = info->class;
+  n = (size + (1 << SLOTLOG2(class)) - 1) >> SLOTLOG2(class);
+  if (n == 0)
+    {
+      n = 1;
+    }
+
+  // all slots of the request at once
+  markRun(info->map, (ptr - BASEADDR(ptr)) >> SLOTLOG2(class), n, FALSE);
+  info->used -= n;
+
+  if (info->used == 0)
+    {
+      releasePage(id);
+    }
+  else
+    {
+      updateLongest(id);
+    }
+}
+
+int
+classOf(kma_size_t size)
+{
+  int class = 0;
+
+  while (class < NUMBERCLASS - 1 && size > (MAXRUN << SLOTLOG2(class)))
+    {
+      class++;
+    }
+
+  return class;
+}
+
+/* A page for the class with all of its slots free, on the list of its
+ * longest run; returns its page number.
+ */
+int
+newPage(int class)
+{
+  kma_page_t* page;
+  page_info_t* info;
+  int i, class2, run;
+
+  if (spare_count > 0)
+    {
+      page = spare_pages[--spare_count];
+    }
+  else
+    {
+      page = get_page();
+    }
+
+  if (info_dir_run == NULL)
+    {
+      growInfoDir(1);
+      pool_base = page->ptr - (long) page->id * PAGESIZE;
+      for (class2 = 0; class2 < NUMBERCLASS; class2++)
+	{
+	  for (run = 0; run <= MAXRUN; run++)
+	    {
+	      bin_head[class2][run] = -1;
+	    }
+	}
+    }
+  pages_in_use++;
+
+  info = newInfo(page->id);
+  info->class = class;
+  info->used = 0;
+  info->longest = 0;
+  for (i = 0; i < WORDS(class); i++)
+    {
+      info->map[i] = 0;
+    }
+  if (SLOTS(class) % 64 != 0)
+    {
+      // the bits past the last slot never look free
+      info->map[WORDS(class) - 1] = ~0ULL << (SLOTS(class) % 64);
+    }
+  updateLongest(page->id);
+
+  return page->id;
+}
+
+/* The table entry of a page coming into use, bringing in its table page.
+ */
+page_info_t*
+newInfo(int id)
+{
+  info_dir_t* entry;
+
+  if (id / INFOPERPAGE >= info_entries)
+    {
+      growInfoDir(id / INFOPERPAGE + 1);
+    }
+
+  entry = &info_dir[id / INFOPERPAGE];
+  if (entry->pages++ == 0)
+    {
+      entry->infos = get_page()->ptr;
+    }
+  return INFO(id);
+}
+
+/* Move the directory to a run with room for at least entries table pages.
+ */
+void
+growInfoDir(int entries)
+{
+  int pages = (entries * sizeof(info_dir_t) + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* run = get_pages(pages);
+  int old = info_dir_run == NULL ? 0 : info_entries;
+
+  if (run == NULL)
+    {
+      error("unable to allocate", "the page table directory");
+    }
+  memcpy(run->ptr, info_dir, old * sizeof(info_dir_t));
+  memset(run->ptr + old * sizeof(info_dir_t), 0,
+	 pages * PAGESIZE - old * sizeof(info_dir_t));
+  if (info_dir_run != NULL)
+    {
+      free_pages(info_dir_run);
+    }
+
+  info_dir_run = run;
+  info_dir = run->ptr;
+  info_entries = pages * PAGESIZE / sizeof(info_dir_t);
+}
+
+/* Give back an empty page, keeping a few spares while other pages are in
+ * use, and its table page once that describes no page in use.
+ */
+void
+releasePage(int id)
+{
+  kma_page_t* page = kma_page_from_addr(pool_base + (long) id * PAGESIZE);
+  info_dir_t* entry = &info_dir[id / INFOPERPAGE];
+
+  unlinkPage(id);
+  if (--entry->pages == 0)
+    {
+      free_page(kma_page_from_addr(entry->infos));
+      entry->infos = NULL;
+    }
+
+  pages_in_use--;
+  if (pages_in_use > 0 && spare_count < SPAREPAGES)
+    {
+      spare_pages[spare_count++] = page;
+      return;
+    }
+
+  free_page(page);
+
+  //nothing is allocated anymore, release the spares and the directory
+  //as well
+  if (pages_in_use == 0)
+    {
+      while (spare_count > 0)
+	{
+	  free_page(spare_pages[--spare_count]);
+	}
+      free_pages(info_dir_run);
+      info_dir_run = NULL;
+    }
+}
+
+void
+linkPage(int id)
+{
+  page_info_t* info = INFO(id);
+  int* head = &bin_head[info->class][info->longest];
+
+  info->prev = -1;
+  info->next = *head;
+  if (*head >= 0)
+    {
+      INFO(*head)->prev = id;
+    }
+  *head = id;
+  bin_mask[info->class] |= 1ULL << (info->longest - 1);
+}
+
+void
+unlinkPage(int id)
+{
+  page_info_t* info = INFO(id);
+
+  if (info->longest == 0)
+    {
+      // full, on no list
+      return;
+    }
+
+  if (info->prev >= 0)
+    {
+      INFO(info->prev)->next = info->next;
+    }
+  else
+    {
+      bin_head[info->class][info->longest] = info->next;
+      if (info->next < 0)
+	{
+	  bin_mask[info->class] &= ~(1ULL << (info->longest - 1));
+	}
+    }
+  if (info->next >= 0)
+    {
+      INFO(info->next)->prev = info->prev;
+    }
+}
+
+/* Scan the page's bitmap for its longest run again and move the page to
+ * that list.
+ */
+void
+updateLongest(int id)
+{
+  page_info_t* info = INFO(id);
+  int longest = longestRun(info->map, WORDS(info->class));
+
+  if (longest == info->longest)
+    {
+      return;
+    }
+
+  unlinkPage(id);
+  info->longest = longest;
+  if (longest > 0)
+    {
+      linkPage(id);
+    }
+}
+
+/* A bit per bitmap word with a free slot, found four words (AVX2) or two
+ * words (SSE2) at a time by comparing them against all ones.
+ */
+uint64_t
+notFullWords(const uint64_t* map, int words)
+{
+  uint64_t mask = 0;
+  int i = 0;
+
+#ifdef __AVX2__
+  const __m256i ones = _mm256_set1_epi64x(-1);
+
+  for (; i + 4 <= words; i += 4)
+    {
+      __m256i full = _mm256_cmpeq_epi64(
+	_mm256_loadu_si256((const __m256i*) (map + i)), ones);
+
+      mask |= (uint64_t) (~_mm256_movemask_pd(_mm256_castsi256_pd(full))
+			  & 0xf) << i;
+    }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi32(-1);
+
+  for (; i + 2 <= words; i += 2)
+    {
+      // no 64 bit compare in SSE2: a word is full if both halves are
+      int full = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+	_mm_loadu_si128((const __m128i*) (map + i)), ones)));
+
+      mask |= (uint64_t) (((full & 0x3) != 0x3) | (((full & 0xc) != 0xc) << 1))
+	<< i;
+    }
+#endif
+
+  for (; i < words; i++)
+    {
+      mask |= (uint64_t) (map[i] != ~0ULL) << i;
+    }
+
+  return mask;
+}
+
+/* The first slot of the lowest run of n free slots (n <= 64), or -1. A run
+ * lies in one word or crosses into the next one.
+ */
+int
+findRun(const uint64_t* map, int words, int n)
+{
+  uint64_t candidates = notFullWords(map, words);
+  uint64_t free, starts;
+  int i, shift, len, prev = -2, tail = 0;
+
+  while (candidates != 0)
+    {
+      i = __builtin_ctzll(candidates);
+      candidates &= candidates - 1;
+      free = ~map[i];
+
+      if (i != prev + 1)
+	{
+	  tail = 0;
+	}
+
+      // free slots at the top of the previous word and the bottom of this one
+      if (tail > 0 && tail + (map[i] == 0 ? 64 : __builtin_ctzll(map[i])) >= n)
+	{
+	  return i * 64 - tail;
+	}
+
+      // the bits where n free slots in a row start
+      starts = free;
+      for (len = 1; len < n; len += shift)
+	{
+	  shift = len < n - len ? len : n - len;
+	  starts &= starts >> shift;
+	}
+      if (starts != 0)
+	{
+	  return i * 64 + __builtin_ctzll(starts);
+	}
+
+      tail = __builtin_clzll(map[i]);
+      prev = i;
+    }
+
+  return -1;
+}
+
+/* The longest run of free slots, up to MAXRUN.
+ */
+int
+longestRun(const uint64_t* map, int words)
+{
+  uint64_t candidates = notFullWords(map, words);
+  uint64_t free;
+  int i, len, prev = -2, run = 0, longest = 0;
+
+  while (candidates != 0 && longest < MAXRUN)
+    {
+      i = __builtin_ctzll(candidates);
+      candidates &= candidates - 1;
+      free = ~map[i];
+
+      if (i != prev + 1)
+	{
+	  run = 0;
+	}
+      prev = i;
+
+      if (map[i] == 0)
+	{
+	  run += 64;
+	  longest = run > longest ? run : longest;
+	  continue;
+	}
+
+      // the run going on from the previous word ends in this one
+      run += __builtin_ctzll(map[i]);
+      longest = run > longest ? run : longest;
+
+      // runs inside the word: each step shortens every run by one
+      for (len = 0; free != 0; len++)
+	{
+	  free &= free >> 1;
+	}
+      longest = len > longest ? len : longest;
+
+      run = __builtin_clzll(map[i]);
+    }
+
+  return longest < MAXRUN ? longest : MAXRUN;
+}
+
+/* Set (allocate) or clear (free) the bits of n slots from the first.
+ */
+void
+markRun(uint64_t* map, int first, int n, bool allocate)
+{
+  uint64_t bits;
+  int i = first / 64, bit = first % 64, len;
+
+  while (n > 0)
+    {
+      len = n < 64 - bit ? n : 64 - bit;
+      bits = (len == 64 ? ~0ULL : ((1ULL << len) - 1)) << bit;
+      if (allocate)
+	{
+	  assert((map[i] & bits) == 0);
+	  map[i] |= bits;
+	}
+      else
+	{
+	  assert((map[i] & bits) == bits);
+	  map[i] &= ~bits;
+	}
+      n -= len;
+      i++;
+      bit = 0;
+    }
+}
+
+#endif // KMA_BMAP
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -53,34 +54,114 @@
 #define MINBUFSIZE 32 
 #define NUMBERBUF PAGESIZE / MINBUFSIZE
 
+//pages are binned by their longest free length: bin i holds the pages
+//whose length is 2^i, bin 16 + i those whose length lies strictly
+//between 2^i and 2^(i+1). Lengths stay below 64 KB. A length that is
+//not a power of two is a node cut short by the header, and all such
+//nodes between two powers of two have the same length.
+#define NUMBERBIN 32
+
+//a bin is a bitmap over the page numbers of the pool, kept in map pages
+//from the page layer: a map page holds MAPWORDS words of every bin for
+//a chunk of MAPPAGES page numbers, with a bit per word that is not
+//zero, and a bit per chunk with pages in the bin sits in the control
+//run above them, so the lowest page of a bin is found with three ctz
+#define MAPWORDS (PAGESIZE / 16 / NUMBERBIN < 64 ? PAGESIZE / 16 / NUMBERBIN : 64)
+#define MAPPAGES (MAPWORDS * 64)
+
+//a node's longest free length is kept in one byte as a code: code k
+//stands for the power of two MINBUFSIZE << (k - 1), code TRUNCATED + k
+//for the length of the node of that size cut short by the header (all
+//such nodes of a level have the same length), and 0 for no free space.
+//This halves the header, which is 1/16 of the page.
+#define NUMBERORDER 16
+#define TRUNCATED NUMBERORDER
+#define ORDER(size) (__builtin_ctz(size) - __builtin_ctz(MINBUFSIZE) + 1)
+
 typedef struct {
-  kma_page_t* next_page;
-  uint8_t large;
-  uint16_t longest_length[2 * NUMBERBUF - 1];
+  int8_t bin;
+  uint8_t longest_code[2 * NUMBERBUF - 1];
 } page_header_t;
 
+#define LENGTH(page_header, index) (code_length[(page_header)->longest_code[index]])
+
+typedef struct {
+  uint64_t used[NUMBERBIN];
+  uint64_t map[NUMBERBIN][MAPWORDS];
+} bin_page_t;
+
+//a chunk's map page and the pages of the chunk in use; the map page is
+//taken when the first of them is binned and given back with the last
+typedef struct {
+  bin_page_t* bins;
+  int pages;
+} chunk_t;
+
 /************Global Variables*********************************************/
-kma_page_t* first_page = NULL;
+//the control run: the chunks of the pool, then per bin a bit per chunk
+//with pages in the bin (top_words words each); sized from the pages of
+//the pool when the first page is taken
+static kma_page_t* control_run = NULL;
+static chunk_t* chunks;
+static uint64_t* bin_top;
+static int top_words;
+
+//the top words that may have a bit set, up to the highest chunk binned
+static int top_limit = 0;
+
+//the address of page number 0 of the pool
+static void* pool_base = NULL;
+
+static int pages_in_use = 0;
+
+//empty pages kept for reuse instead of being released
+static kma_page_t* spare_pages[SPAREPAGES];
+static int spare_count = 0;
+
+static kma_buddy_stat_t buddy_stat;
+
+//the length each code stands for
+static kma_size_t code_length[2 * NUMBERORDER];
+
+//the header of an empty page, built once (its bin is -1 from then on)
+//and copied into every new page
+static page_header_t header_image;
 
 /************Function Prototypes******************************************/
-void init_header(kma_page_t*);
+static void init_header(kma_page_t*);
+
+static kma_page_t* search_page(kma_size_t);
+
+static kma_size_t real_size(int, kma_size_t);
 
-kma_page_t* search_page(kma_size_t);
+static uint8_t size_code(int, kma_size_t);
 
-kma_page_t* search_free_page(void*);
+static uint8_t larger_code(page_header_t*, int);
 
-kma_size_t real_size(int, kma_size_t);
+static int get_bin(kma_page_t*);
 
-void delete_page(kma_page_t*);
+static int first_in_bin(int);
+
+static void link_page(kma_page_t*);
+
+static void unlink_page(kma_page_t*);
+
+static void delete_page(kma_page_t*);
+
+static kma_page_t* new_page(void);
+
+static void release_page(kma_page_t*);
+
+static void init_bins(void);
 
 //utility functions
-kma_size_t get_round(kma_size_t);
-int get_left_child(int);
-int get_right_child(int);
-int get_parent(int);
-int get_offset(int, kma_size_t);
-bool is_powerof2(int);
-int get_larger(int, int);
+static kma_size_t get_round(kma_size_t);
+static int get_left_child(int);
+static int get_right_child(int);
+static int get_parent(int);
+static int get_offset(int, kma_size_t);
+static bool is_powerof2(int);
+static bool is_large(kma_size_t);
 
 	
 /************External Declaration*****************************************/
@@ -88,13 +169,6 @@ int get_larger(int, int);
 /**************Implementation**********************************************/
 
 /**************utilization function****************************************/
-int get_larger(int x, int y){
-  if (x > y)
-    return x;
-  else
-    return y;
-}
-
 kma_size_t get_round(kma_size_t size)
 {
   size = size | (size >> 1);
@@ -110,6 +184,11 @@ bool is_powerof2(int x){
   return(!(x & (x - 1)));
 }
 
+//requests that do not fit next to the header get a whole page of their own
+bool is_large(kma_size_t size){
+  return (size + sizeof(page_header_t)) > PAGESIZE;
+}
+
 int get_offset(int x, kma_size_t size){
   return ((x+1)*size-PAGESIZE);
 }
@@ -132,29 +211,26 @@ int get_right_child(int x){
 //making a array to track each buffer's size and usage 
 void init_header(kma_page_t* page)
 {
-  int real_length;
-  kma_size_t i, node_size = 2 * PAGESIZE;
-  kma_size_t offset, pre_filled_offset;
-
-  page_header_t* page_header;
-  page_header = (page_header_t*)(page->ptr);
-  page_header->next_page = NULL;
-  page_header->large = 0;
-
-  pre_filled_offset = sizeof(page_header_t);
+  kma_size_t i, length, node_size = 2 * PAGESIZE;
+
+  if (header_image.bin == 0){
+    //the codes of the leftmost node of each level, the one the header cuts
+    for (node_size = MINBUFSIZE; node_size <= PAGESIZE; node_size *= 2){
+      code_length[ORDER(node_size)] = node_size;
+      length = real_size(PAGESIZE / node_size - 1, node_size);
+      code_length[TRUNCATED + ORDER(node_size)] = length > 0 ? length : 0;
+    }
+    node_size = 2 * PAGESIZE;
 
-  for (i = 0; i < 2 * NUMBERBUF - 1; i++)
-  {
-    if (is_powerof2(i + 1)) node_size = node_size / 2;
-    
-    offset = get_offset(i, node_size);
-    if (offset < pre_filled_offset)
+    header_image.bin = -1;
+    for (i = 0; i < 2 * NUMBERBUF - 1; i++)
     {
-      real_length = offset + node_size - pre_filled_offset;
-      page_header->longest_length[i] = real_length > 0 ? real_length : 0;
-    } else
-      page_header->longest_length[i] = node_size;
+      if (is_powerof2(i + 1)) node_size = node_size / 2;
+      header_image.longest_code[i] = size_code(i, node_size);
+    }
   }
+
+  memcpy(page->ptr, &header_image, sizeof(page_header_t));
 }
 
 void*
@@ -168,17 +244,17 @@ kma_malloc(kma_size_t size)
   kma_page_t* page;
   page_header_t* page_header;
 
-  page = search_page(size);
-  if (page == NULL)
-    return NULL;
-  else
-  {
-    page_header = page->ptr;
-    if ((size + sizeof(page_header_t)) > PAGESIZE)
-    {
-      page_header->large = 1;
-      return page->ptr + sizeof(kma_page_t*) + sizeof(uint8_t);
-    }
+  //no block is smaller; a zero byte request would otherwise descend
+  //into a full node and reach __builtin_clz(0) in search_page
+  if (size < MINBUFSIZE)
+    size = MINBUFSIZE;
+
+  if (is_large(size)){
+    if (size > PAGESIZE)
+      return NULL;
+    //kept off the page list, kma_free finds it by address
+    page = new_page();
+    return page->ptr;
   }
 
   if (!is_powerof2(size))
@@ -189,20 +265,30 @@ kma_malloc(kma_size_t size)
   if (power_size < MINBUFSIZE)
     power_size = MINBUFSIZE;
 
+  page = search_page(size);
+  page_header = page->ptr;
+
   for (node_size = PAGESIZE; node_size != power_size; node_size /= 2)
   {
-    if (page_header->longest_length[get_left_child(index)] >= size)
+    if (LENGTH(page_header, index) == real_size(index, node_size))
+      buddy_stat.num_splits++;
+    if (LENGTH(page_header, get_left_child(index)) >= size)
       index = get_left_child(index);
     else
       index = get_right_child(index);
   }
 
-  offset = get_offset(index, node_size) + node_size - page_header->longest_length[index];
-  page_header->longest_length[index] = 0;
+  offset = get_offset(index, node_size) + node_size - LENGTH(page_header, index);
+  page_header->longest_code[index] = 0;
 
   while (index){
     index = get_parent(index);
-    page_header->longest_length[index] = get_larger(page_header->longest_length[get_left_child(index)], page_header->longest_length[get_right_child(index)]);
+    page_header->longest_code[index] = larger_code(page_header, index);
+  }
+
+  if (get_bin(page) != page_header->bin){
+    unlink_page(page);
+    link_page(page);
   }
 
   return page->ptr + offset;
@@ -211,17 +297,21 @@ kma_malloc(kma_size_t size)
 void 
 kma_free(void* ptr, kma_size_t size)
 {
-  kma_page_t* page = search_free_page(ptr);
-  page_header_t* page_header = page->ptr;
+  kma_page_t* page;
+  page_header_t* page_header;
   kma_size_t left_length, right_length;
   kma_size_t node_size;
   int index = 0;
   int offset;
 
-  if (page_header->large == 1){
-    delete_page(page);
+  if (is_large(size)){
+    release_page(kma_page_from_addr(ptr));
     return;
   }
+
+  //the owner of a block is the page it lies in
+  page = kma_page_from_addr(ptr);
+  page_header = page->ptr;
   
   node_size = MINBUFSIZE;
   offset = ptr - page->ptr;
@@ -230,76 +320,73 @@ kma_free(void* ptr, kma_size_t size)
 
   index = (offset + PAGESIZE) / node_size - 1;
 
-  for (; page_header->longest_length[index] != 0; index = get_parent(index))
+  for (; page_header->longest_code[index] != 0; index = get_parent(index))
     node_size = node_size * 2;
 
-  page_header->longest_length[index] = (uint16_t)real_size(index, node_size);
+  page_header->longest_code[index] = size_code(index, node_size);
   //printf("FREE: Size is %d, offset is %d, index is %d", size, offset, index);
 
   while (index){
     index = get_parent(index);
     node_size = node_size * 2;
-    left_length = page_header->longest_length[get_left_child(index)];
-    right_length = page_header->longest_length[get_right_child(index)];
+    left_length = LENGTH(page_header, get_left_child(index));
+    right_length = LENGTH(page_header, get_right_child(index));
 
-    if (left_length + right_length == real_size(index, node_size))
-      page_header->longest_length[index] = (uint16_t)real_size(index, node_size);
+    if (left_length + right_length == real_size(index, node_size)){
+      page_header->longest_code[index] = size_code(index, node_size);
+      buddy_stat.num_merges++;
+    }
     else
-      page_header->longest_length[index] = get_larger(left_length, right_length);
+      page_header->longest_code[index] = larger_code(page_header, index);
   }
 
-  if (page_header->longest_length[0] == (PAGESIZE - sizeof(page_header_t)))
+  if (LENGTH(page_header, 0) == (PAGESIZE - sizeof(page_header_t)))
     delete_page(page);
+  else if (get_bin(page) != page_header->bin){
+    unlink_page(page);
+    link_page(page);
+  }
 }
 
-kma_page_t* search_page(kma_size_t size)
+kma_buddy_stat_t* buddy_stats()
 {
-  kma_page_t* page = first_page;
-  page_header_t* page_header;
-
-  if ((size + sizeof(kma_page_t*)) > PAGESIZE)
-    return NULL;
+  return &buddy_stat;
+}
 
-  if (page == NULL){
-    page = get_page();
-    init_header(page);
-    first_page = page;
-    return page;
+//the lowest page of the pool with a free length of at least size, or a
+//new page if there is none
+kma_page_t* search_page(kma_size_t size)
+{
+  kma_page_t* page;
+  int bin, id, lowest = -1;
+  int order = 31 - __builtin_clz(size);
+
+  //every page of these bins is large enough
+  for (bin = order + !is_powerof2(size); bin < 16; bin++){
+    id = first_in_bin(bin);
+    if (id >= 0 && (lowest < 0 || id < lowest))
+      lowest = id;
+    id = first_in_bin(16 + bin);
+    if (id >= 0 && (lowest < 0 || id < lowest))
+      lowest = id;
   }
-  else{
-    while (page != NULL){
-      page_header = (page_header_t*)page->ptr;
-
-      if (page_header->large != 1 && page_header->longest_length[0] >= size)
-        return page;
-
-      if (page_header->next_page == NULL){
-        page_header->next_page = get_page();
-        init_header(page_header->next_page);
-        return page_header->next_page;
-      }
-      /*printf("size, %d, length: %d\n", size, page_header->longest_length[0]);*/
 
-      page = page_header->next_page;
+  //the pages of this bin all have the same length, check one of them
+  if (!is_powerof2(size)){
+    id = first_in_bin(16 + order);
+    if (id >= 0 && (lowest < 0 || id < lowest)){
+      page = kma_page_from_addr(pool_base + (long)id * PAGESIZE);
+      if (LENGTH((page_header_t*)(page->ptr), 0) >= size)
+        lowest = id;
     }
   }
-  return NULL;
-}
 
-kma_page_t* search_free_page(void* ptr)
-{
-  kma_page_t* page = first_page;
-  page_header_t* page_header;
-  int offset;
+  if (lowest >= 0)
+    return kma_page_from_addr(pool_base + (long)lowest * PAGESIZE);
 
-  while (page){
-    page_header = (page_header_t*)(page->ptr);
-    offset = ptr - page->ptr;
-    if (offset > 0 && offset < PAGESIZE)
-      return page;
-    page = page_header->next_page;
-  }
-  return NULL;
+  page = new_page();
+  link_page(page);
+  return page;
 }
 
 kma_size_t real_size(int index, kma_size_t node_size)
@@ -314,25 +401,173 @@ kma_size_t real_size(int index, kma_size_t node_size)
   return size;
 }
 
+//the code of a node that is free as a whole
+uint8_t size_code(int index, kma_size_t node_size)
+{
+  kma_size_t length = real_size(index, node_size);
+
+  if (length <= 0)
+    return 0;
+  if (length == node_size)
+    return ORDER(node_size);
+  return TRUNCATED + ORDER(node_size);
+}
+
+//the code of the child of a node with the longer free length
+uint8_t larger_code(page_header_t* page_header, int index)
+{
+  int left = get_left_child(index), right = get_right_child(index);
+
+  if (LENGTH(page_header, left) > LENGTH(page_header, right))
+    return page_header->longest_code[left];
+  return page_header->longest_code[right];
+}
+
+//the bin of a page by its longest free length, -1 if it is full
+int get_bin(kma_page_t* page)
+{
+  int length = LENGTH((page_header_t*)(page->ptr), 0);
+
+  if (length == 0)
+    return -1;
+  if (is_powerof2(length))
+    return 31 - __builtin_clz(length);
+  return 16 + 31 - __builtin_clz(length);
+}
+
+//the lowest page number in a bin, -1 if it is empty
+int first_in_bin(int bin)
+{
+  uint64_t* top = bin_top + bin * top_words;
+  bin_page_t* bins;
+  int i, chunk, word;
+
+  for (i = 0; i < top_limit; i++){
+    if (top[i] == 0)
+      continue;
+    chunk = i * 64 + __builtin_ctzll(top[i]);
+    bins = chunks[chunk].bins;
+    word = __builtin_ctzll(bins->used[bin]);
+    return chunk * MAPPAGES + word * 64 + __builtin_ctzll(bins->map[bin][word]);
+  }
+  return -1;
+}
+
+void link_page(kma_page_t* page)
+{
+  page_header_t* page_header = page->ptr;
+  int bin = get_bin(page);
+  int chunk = page->id / MAPPAGES;
+  int word = page->id % MAPPAGES / 64;
+  bin_page_t* bins;
+
+  page_header->bin = bin;
+  if (bin < 0)
+    return;
+
+  bins = chunks[chunk].bins;
+  if (bins == NULL){
+    bins = chunks[chunk].bins = get_page()->ptr;
+    memset(bins, 0, sizeof(bin_page_t));
+    if (chunk / 64 >= top_limit)
+      top_limit = chunk / 64 + 1;
+  }
+
+  bins->map[bin][word] |= 1ULL << (page->id % 64);
+  bins->used[bin] |= 1ULL << word;
+  bin_top[bin * top_words + chunk / 64] |= 1ULL << (chunk % 64);
+}
+
+void unlink_page(kma_page_t* page)
+{
+  page_header_t* page_header = page->ptr;
+  int bin = page_header->bin;
+  int chunk = page->id / MAPPAGES;
+  int word = page->id % MAPPAGES / 64;
+  bin_page_t* bins = chunks[chunk].bins;
+
+  if (bin < 0)
+    return;
+
+  bins->map[bin][word] &= ~(1ULL << (page->id % 64));
+  if (bins->map[bin][word] == 0){
+    bins->used[bin] &= ~(1ULL << word);
+    if (bins->used[bin] == 0)
+      bin_top[bin * top_words + chunk / 64] &= ~(1ULL << (chunk % 64));
+  }
+  page_header->bin = -1;
+}
+
 void delete_page(kma_page_t* page)
 {
-  kma_page_t* current_page = first_page;
-  page_header_t* current_header = first_page->ptr;
+  unlink_page(page);
+  release_page(page);
+}
+
+//take a spare page if there is one, otherwise a new one from the page layer
+kma_page_t* new_page(void)
+{
+  kma_page_t* page;
+
+  if (spare_count > 0)
+    page = spare_pages[--spare_count];
+  else
+    page = get_page();
 
-  if (page->id == current_page->id){
-    first_page = current_header->next_page;
-    free_page(page);
+  pool_base = page->ptr - (long)page->id * PAGESIZE;
+  if (control_run == NULL)
+    init_bins();
+
+  init_header(page);
+  chunks[page->id / MAPPAGES].pages++;
+  pages_in_use++;
+  return page;
+}
+
+//the control run for the pages of the pool, which are known once the
+//page layer handed out its first page
+void init_bins(void)
+{
+  int number_chunk = (page_stats()->max_pages + MAPPAGES - 1) / MAPPAGES;
+  int bytes;
+
+  top_words = (number_chunk + 63) / 64;
+  bytes = number_chunk * sizeof(chunk_t) + NUMBERBIN * top_words * sizeof(uint64_t);
+  control_run = get_pages((bytes + PAGESIZE - 1) / PAGESIZE);
+  if (control_run == NULL)
+    error("unable to allocate", "the KMA_BUD bins");
+  memset(control_run->ptr, 0, bytes);
+
+  chunks = control_run->ptr;
+  bin_top = (uint64_t*)(chunks + number_chunk);
+  top_limit = 0;
+}
+
+//keep an empty page as a spare while other pages are still in use, and
+//give back the map page of its chunk once no page of it is in use
+void release_page(kma_page_t* page)
+{
+  chunk_t* chunk = &chunks[page->id / MAPPAGES];
+
+  if (--chunk->pages == 0 && chunk->bins != NULL){
+    free_page(kma_page_from_addr(chunk->bins));
+    chunk->bins = NULL;
   }
-  else{
-    while (current_header->next_page){
-      if (current_header->next_page->id == page->id){
-        current_header->next_page = ((page_header_t*)(page->ptr))->next_page;
-        free_page(page);
-        break;
-      }
-      current_page = current_header->next_page;
-      current_header = (page_header_t*)(current_page->ptr);
-    }
+
+  pages_in_use--;
+  if (pages_in_use > 0 && spare_count < SPAREPAGES){
+    spare_pages[spare_count++] = page;
+    return;
+  }
+
+  free_page(page);
+
+  //nothing is allocated anymore, release the spares and the bins as well
+  if (pages_in_use == 0){
+    while (spare_count > 0)
+      free_page(spare_pages[--spare_count]);
+    free_pages(control_run);
+    control_run = NULL;
   }
 }
 #endif // KMA_BUD
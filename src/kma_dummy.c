@@ -69,36 +69,33 @@
 void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
+  int npages;
   
-  // get one page
-  page = get_page();
+  // get enough pages for the request
+  npages = (size + PAGESIZE - 1) / PAGESIZE;
+  if (npages == 1)
+    page = get_page();
+  else
+    page = get_pages(npages);
   
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
+  if (page == NULL)
+    { // no run large enough
       return NULL;
     }
   
-  // check whether the BASEADDR macro works
-  //for (i = 0; i < page->size; i++)
-  //{
-  //  assert(BASEADDR(page->ptr + i) == page->ptr);
-  //}
-  // oh yea, it worked
+  // no need to keep a pointer to the page structure, the page frame
+  // table finds it from any address inside the page
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
   kma_page_t* page;
   
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  page = kma_page_from_addr(ptr);
   
-  free_page(page);
+  free_pages(page);
 }
 
 #endif // KMA_DUMMY
@@ -0,0 +1,492 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on a buddy system spanning
+ *             the whole page pool
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the global buddy allocator
+ *
+ ***************************************************************************/
+#ifdef KMA_GBUD
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// smallest block is 32 bytes
+#define MINORDER 5
+
+// blocks of this order and above are whole pages
+#define PAGEORDER __builtin_ctz(PAGESIZE)
+
+// the largest block is a huge page, the unit the pool is aligned to;
+// larger requests get a run of pages of their own
+#define MAXORDER 21
+
+#if HUGEPAGESIZE != (1 << MAXORDER)
+#error "KMA_GBUD expects MAXORDER to be the order of a huge page"
+#endif
+
+#define BLOCKSIZE(order) (1L << (order))
+#define PAGESOF(order) ((int) (BLOCKSIZE(order) / PAGESIZE))
+
+// offset of a block from the start of the pool; a block of order k
+// starts at a multiple of 2^k, and its buddy differs in bit k only
+#define OFFSET(block) ((void*) (block) - pool_base)
+#define BUDDY(block, order) (pool_base + (OFFSET(block) ^ BLOCKSIZE(order)))
+
+// pair bits: a huge page region has 2^(MAXORDER - k - 1) pairs of
+// blocks of order k, REGIONBITS for all orders below MAXORDER. The bits
+// of PAIRREGIONS neighbouring regions are kept in a unit of PAIRPAGES
+// pages from the page layer.
+#define REGIONBITS (1 << (MAXORDER - MINORDER))
+#define PAIRBYTES (REGIONBITS / 8)
+#define PAIRPAGES ((PAIRBYTES + PAGESIZE - 1) / PAGESIZE)
+#define PAIRREGIONS (PAIRBYTES >= PAGESIZE ? 1 : PAGESIZE / PAIRBYTES)
+
+typedef struct block
+{
+  struct block* next;
+  struct block* prev;
+} block_t;
+
+// a unit of pair bits, and the pages of its regions in the zone: pages
+// not in the zone count as allocated, so without any all bits are clear
+// and the unit goes back to the page layer
+typedef struct
+{
+  kma_page_t* page;
+  int zone_pages;
+} pair_unit_t;
+
+/************Global Variables*********************************************/
+
+// free blocks of each order, and a bit per order whose list is not empty
+static block_t* free_list[MAXORDER + 1];
+static unsigned int free_orders = 0;
+
+// one bit per pair of buddies of each order below MAXORDER: set iff
+// exactly one of the two is a free block of that order. Freeing a block
+// flips it, and a bit that ends up clear means the buddy is free too and
+// the two merge. The units of bits are found through a directory over
+// the whole pool, itself a run of pages while the zone has pages, and
+// pair_base is where each order starts in the bits of a region.
+static pair_unit_t* pair_dir = NULL;
+static kma_page_t* pair_dir_page = NULL;
+static int pair_units = 0;
+static int pair_base[MAXORDER];
+
+// the address of page number 0 of the pool
+static void* pool_base = NULL;
+
+// blocks handed out, and pages of the free blocks of PAGEORDER and above
+static int blocks_in_use = 0;
+static int free_pages_in_zone = 0;
+
+static kma_buddy_stat_t buddy_stat;
+
+/************Function Prototypes******************************************/
+int orderOf(kma_size_t);
+void* takeBlock(int);
+int freeBlock(void**, int);
+bool flipPair(void*, int);
+void pushBlock(void*, int);
+void unlinkBlock(void*, int);
+bool growZone(int);
+void initZone(kma_page_t*);
+void zonePages(void*, int);
+void releaseBlock(void*, int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page;
+  void* block;
+
+  if (size > BLOCKSIZE(MAXORDER))
+    {
+      // larger than any block, a run of pages outside the zone
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return page == NULL ? NULL : page->ptr;
+    }
+
+  block = takeBlock(orderOf(size));
+  if (block != NULL)
+    {
+      blocks_in_use++;
+    }
+
+  return block;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int order;
+
+  if (size > BLOCKSIZE(MAXORDER))
+    {
+      free_pages(kma_page_from_addr(ptr));
+      return;
+    }
+
+  blocks_in_use--;
+  order = freeBlock(&ptr, orderOf(size));
+  buddy_stat.num_merges += order - orderOf(size);
+
+  // whole free pages go back to the page layer, except for a few spares
+  // while blocks are still in use
+  if (blocks_in_use == 0)
+    {
+      for (order = PAGEORDER; order <= MAXORDER; order++)
+	{
+	  while (free_list[order] != NULL)
+	    {
+	      releaseBlock(free_list[order], order);
+	    }
+	}
+    }
+  else if (order >= PAGEORDER && free_pages_in_zone > SPAREPAGES)
+    {
+      releaseBlock(ptr, order);
+    }
+}
+
+kma_buddy_stat_t*
+buddy_stats()
+{
+  return &buddy_stat;
+}
+
+int
+orderOf(kma_size_t size)
+{
+  int order = MINORDER;
+
+  while (BLOCKSIZE(order) < size)
+    {
+      order++;
+    }
+
+  return order;
+}
+
+/* Take a free block of the order from the smallest order that has one,
+ * growing the zone if none has, and split it down. NULL if the zone
+ * cannot grow.
+ */
+void*
+takeBlock(int order)
+{
+  void* block;
+  unsigned int orders;
+  int from;
+
+  while ((orders = free_orders & (~0U << order)) == 0)
+    {
+      if (!growZone(order))
+	{
+	  return NULL;
+	}
+    }
+
+  from = __builtin_ctz(orders);
+  block = free_list[from];
+  unlinkBlock(block, from);
+  flipPair(block, from);
+
+  // the upper half of each split stays free
+  while (from > order)
+    {
+      from--;
+      pushBlock(block + BLOCKSIZE(from), from);
+      flipPair(block + BLOCKSIZE(from), from);
+      buddy_stat.num_splits++;
+    }
+
+  return block;
+}
+
+/* Free a block of the order, merging it with its buddy as long as that
+ * is free as a whole. The merged block is left in *block; returns its
+ * order, so the caller can count the merges.
+ */
+int
+freeBlock(void** block, int order)
+{
+  void* buddy;
+
+  while (order < MAXORDER && !flipPair(*block, order))
+    {
+      buddy = BUDDY(*block, order);
+      unlinkBlock(buddy, order);
+      if (buddy < *block)
+	{
+	  *block = buddy;
+	}
+      order++;
+    }
+  pushBlock(*block, order);
+
+  return order;
+}
+
+/* Flip the pair bit of a block that becomes or stops being free, and
+ * return its new value. Blocks of MAXORDER have no buddy.
+ */
+bool
+flipPair(void* block, int order)
+{
+  long offset = OFFSET(block), region = offset >> MAXORDER;
+  uint64_t* bits;
+  int bit;
+
+  if (order == MAXORDER)
+    {
+      return TRUE;
+    }
+
+  bits = pair_dir[region / PAIRREGIONS].page->ptr;
+  bit = (region % PAIRREGIONS) * REGIONBITS + pair_base[order]
+    + ((offset & (HUGEPAGESIZE - 1)) >> (order + 1));
+  bits[bit / 64] ^= 1ULL << (bit % 64);
+
+  return (bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+void
+pushBlock(void* ptr, int order)
+{
+  block_t* block = (block_t*) ptr;
+
+  block->prev = NULL;
+  block->next = free_list[order];
+  if (block->next != NULL)
+    {
+      block->next->prev = block;
+    }
+  free_list[order] = block;
+  free_orders |= 1U << order;
+
+  if (order >= PAGEORDER)
+    {
+      free_pages_in_zone += PAGESOF(order);
+    }
+}
+
+void
+unlinkBlock(void* ptr, int order)
+{
+  block_t* block = (block_t*) ptr;
+
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      free_list[order] = block->next;
+      if (block->next == NULL)
+	{
+	  free_orders &= ~(1U << order);
+	}
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+
+  if (order >= PAGEORDER)
+    {
+      free_pages_in_zone -= PAGESOF(order);
+    }
+}
+
+/* Add pages from the page layer to the zone so a block of the order can
+ * be taken. A block of several pages needs them aligned to its size in
+ * the pool: take a batch of twice as many pages less one, which holds
+ * such a group when the page layer found a run that large, keep the
+ * group as one free block and give the rest back. FALSE if the batch is
+ * not contiguous enough.
+ */
+bool
+growZone(int order)
+{
+  static kma_page_t* batch[2 * (HUGEPAGESIZE / PAGESIZE)];
+  kma_page_t* rest[2 * (HUGEPAGESIZE / PAGESIZE)];
+  void* block = NULL;
+  int n, got, first, i, nrest = 0;
+
+  n = order > PAGEORDER ? PAGESOF(order) : 1;
+  if (n == 1)
+    {
+      batch[0] = get_page();
+      got = 1;
+    }
+  else
+    {
+      got = get_pages_batch(2 * n - 1, batch);
+      if (got == 0)
+	{
+	  return FALSE;
+	}
+    }
+
+  if (pair_dir == NULL)
+    {
+      initZone(batch[0]);
+    }
+
+  // the pages of the batch in the first group of n whose first page
+  // number is a multiple of n
+  first = (batch[0]->id + n - 1) / n * n;
+  for (i = 0; i < got; i++)
+    {
+      if (batch[i]->id >= first && batch[i]->id < first + n)
+	{
+	  if (batch[i]->id == first)
+	    {
+	      block = batch[i]->ptr;
+	    }
+	}
+      else
+	{
+	  rest[nrest++] = batch[i];
+	}
+    }
+
+  if (got - nrest < n)
+    {
+      // the page layer had no run this large, the group is incomplete
+      free_pages_batch(got, batch);
+      if (pair_units == 0)
+	{
+	  free_pages(pair_dir_page);
+	  pair_dir = NULL;
+	}
+      return FALSE;
+    }
+
+  zonePages(block, n);
+  freeBlock(&block, n == 1 ? PAGEORDER : order);
+  free_pages_batch(nrest, rest);
+
+  return TRUE;
+}
+
+/* The directory of the pair bits over the pool the page layer reserved,
+ * and where each order starts in the bits of a region.
+ */
+void
+initZone(kma_page_t* page)
+{
+  long regions;
+  int order, units, bits = 0;
+
+  pool_base = page->ptr - (long) page->id * PAGESIZE;
+
+  for (order = MINORDER; order < MAXORDER; order++)
+    {
+      pair_base[order] = bits;
+      bits += 1 << (MAXORDER - order - 1);
+    }
+
+  regions = ((long) page_stats()->max_pages * PAGESIZE + HUGEPAGESIZE - 1)
+    / HUGEPAGESIZE;
+  units = (regions + PAIRREGIONS - 1) / PAIRREGIONS;
+  pair_dir_page = get_pages((units * sizeof(pair_unit_t) + PAGESIZE - 1)
+			    / PAGESIZE);
+  if (pair_dir_page == NULL)
+    {
+      error("unable to allocate", "the buddy pair directory");
+    }
+  pair_dir = pair_dir_page->ptr;
+  memset(pair_dir, 0, units * sizeof(pair_unit_t));
+}
+
+/* Count pages of a block entering (n > 0) or leaving (n < 0) the zone
+ * against the unit of pair bits of its region: the first pages bring the
+ * unit in, cleared, and the last ones give it back, and the directory
+ * with the last unit.
+ */
+void
+zonePages(void* block, int n)
+{
+  pair_unit_t* unit = &pair_dir[(OFFSET(block) >> MAXORDER) / PAIRREGIONS];
+
+  if (unit->zone_pages == 0)
+    {
+      unit->page = get_pages(PAIRPAGES);
+      if (unit->page == NULL)
+	{
+	  error("unable to allocate", "the buddy pair bits");
+	}
+      memset(unit->page->ptr, 0, PAIRPAGES * PAGESIZE);
+      pair_units++;
+    }
+
+  unit->zone_pages += n;
+
+  if (unit->zone_pages == 0)
+    {
+      free_pages(unit->page);
+      unit->page = NULL;
+      if (--pair_units == 0)
+	{
+	  free_pages(pair_dir_page);
+	  pair_dir = NULL;
+	}
+    }
+}
+
+/* Take a free block of whole pages out of the zone and give its pages
+ * back to the page layer.
+ */
+void
+releaseBlock(void* block, int order)
+{
+  kma_page_t* pages[HUGEPAGESIZE / PAGESIZE];
+  int i;
+
+  unlinkBlock(block, order);
+  flipPair(block, order);
+  zonePages(block, -PAGESOF(order));
+
+  for (i = 0; i < PAGESOF(order); i++)
+    {
+      pages[i] = kma_page_from_addr(block + (long) i * PAGESIZE);
+    }
+  if (PAGESOF(order) == 1)
+    {
+      free_page(pages[0]);
+    }
+  else
+    {
+      free_pages_batch(PAGESOF(order), pages);
+    }
+}
+
+#endif // KMA_GBUD
@@ -0,0 +1,170 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Per-operation latency of a backend replaying a trace
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the latency benchmark
+ *
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct
+{
+  void* ptr;
+  int size;
+} request_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+double now_ns();
+int compareDouble(const void*, const void*);
+void report(char*, double*, int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  request_t* requests;
+  double* malloc_ns;
+  double* free_ns;
+  double start;
+  char command[16];
+  int n_req, req_id, req_size, n_malloc = 0, n_free = 0;
+  FILE* f;
+
+  if (argc != 2)
+    {
+      printf("Usage: %s [trace file]\n", argv[0]);
+      exit(0);
+    }
+
+  f = fopen(argv[1], "r");
+  if (f == NULL)
+    {
+      error("unable to open input test file", argv[1]);
+    }
+  if (fscanf(f, "%d\n", &n_req) != 1)
+    {
+      error("Couldn't read number of requests at head of file", "");
+    }
+
+  requests = calloc(n_req, sizeof(request_t));
+  malloc_ns = malloc(n_req * sizeof(double));
+  free_ns = malloc(n_req * sizeof(double));
+
+  while (fscanf(f, "%10s", command) == 1)
+    {
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(f, "%d %d", &req_id, &req_size) != 2)
+	    {
+	      error("Not enough arguments to REQUEST", "");
+	    }
+	  assert(req_id >= 0 && req_id < n_req);
+
+	  start = now_ns();
+	  requests[req_id].ptr = kma_malloc(req_size);
+	  malloc_ns[n_malloc++] = now_ns() - start;
+	  requests[req_id].size = req_size;
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  if (fscanf(f, "%d", &req_id) != 1)
+	    {
+	      error("Not enough arguments to FREE", "");
+	    }
+	  assert(req_id >= 0 && req_id < n_req);
+
+	  if (requests[req_id].ptr != NULL)
+	    {
+	      start = now_ns();
+	      kma_free(requests[req_id].ptr, requests[req_id].size);
+	      free_ns[n_free++] = now_ns() - start;
+	    }
+	}
+      else
+	{
+	  error("unknown command", command);
+	}
+    }
+  fclose(f);
+
+  report("kma_malloc", malloc_ns, n_malloc);
+  report("kma_free", free_ns, n_free);
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+double
+now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+compareDouble(const void* a, const void* b)
+{
+  double x = *((double*) a), y = *((double*) b);
+
+  return (x > y) - (x < y);
+}
+
+/* Mean, tail percentiles and maximum of the operation times in ns.
+ */
+void
+report(char* name, double* ns, int n)
+{
+  double sum = 0.0;
+  int i;
+
+  if (n == 0)
+    {
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      sum += ns[i];
+    }
+  qsort(ns, n, sizeof(double), compareDouble);
+
+  printf("%-10s %8d ops  mean %8.0f  p99 %8.0f  p99.9 %8.0f  max %10.0f ns\n",
+	 name, n, sum / n, ns[n * 99 / 100], ns[n * 999 / 1000], ns[n - 1]);
+}
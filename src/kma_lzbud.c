@@ -38,6 +38,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,9 +52,84 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// smallest block is 32 bytes
+#define MINORDER 5
+
+// log2 of the page size; the largest block is half a page since the
+// page header takes the beginning of the page
+#if PAGESIZE == 4096
+#define PAGEORDER 12
+#elif PAGESIZE == 8192
+#define PAGEORDER 13
+#elif PAGESIZE == 16384
+#define PAGEORDER 14
+#elif PAGESIZE == 32768
+#define PAGEORDER 15
+#else
+#define PAGEORDER 16
+#endif
+#define MAXORDER (PAGEORDER - 1)
+
+#define BLOCKSIZE(order) (1 << (order))
+#define NMINBLOCKS (PAGESIZE >> MINORDER)
+
+// state of the minimum block a free block starts at: its order and
+// whether it is free to the buddy system or only locally
+#define ORDERMASK 0x3f
+#define GLOBALFREE 0x40
+#define LOCALFREE 0x80
+
+typedef struct block
+{
+  struct block* next;
+  struct block* prev;
+} block_t;
+
+typedef struct
+{
+  int inuse;                  // allocated blocks in the page
+  uint8_t state[NMINBLOCKS];  // per minimum block, 0 unless a free
+                              // block starts there
+} page_header_t;
+
+// the first free block of a page, past the header
+#define HEADEREND \
+  ((sizeof(page_header_t) + BLOCKSIZE(MINORDER) - 1) & ~(BLOCKSIZE(MINORDER) - 1))
+
+#define HEADER(ptr) ((page_header_t*) BASEADDR(ptr))
+#define STATE(ptr) \
+  (HEADER(ptr)->state[((void*) (ptr) - BASEADDR(ptr)) >> MINORDER])
+
 /************Global Variables*********************************************/
 
+// free blocks of each order: globally free ones can merge with their
+// buddy, locally free ones look allocated to the buddy system
+static block_t* global_list[MAXORDER + 1];
+static block_t* local_list[MAXORDER + 1];
+
+// per order: blocks (allocated or free, not merged into a larger one),
+// locally free and globally free blocks; the slack N - 2L - G decides
+// whether a freed block is coalesced
+static int num_blocks[MAXORDER + 1];
+static int num_local[MAXORDER + 1];
+static int num_global[MAXORDER + 1];
+
+static int pages_in_use = 0;
+
+//empty pages kept for reuse instead of being released
+static kma_page_t* spare_pages[SPAREPAGES];
+static int spare_count = 0;
+
+static kma_buddy_stat_t buddy_stat;
+
 /************Function Prototypes******************************************/
+int orderOf(kma_size_t);
+void* takeBlock(int);
+void freeGlobal(void*, int);
+void pushBlock(block_t**, void*);
+void unlinkBlock(block_t**, void*);
+void newPage();
+void releasePage(page_header_t*);
 
 /************External Declaration*****************************************/
 
@@ -61,13 +138,276 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kma_page_t* page;
+  void* block;
+  
+  if (size > BLOCKSIZE(MAXORDER))
+    {
+      // larger than any block, a run of headerless pages
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return page == NULL ? NULL : page->ptr;
+    }
+  
+  block = takeBlock(orderOf(size));
+  HEADER(block)->inuse++;
+  
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  page_header_t* header;
+  void* block;
+  int order, slack;
+  
+  if (size > BLOCKSIZE(MAXORDER))
+    {
+      free_pages(kma_page_from_addr(ptr));
+      return;
+    }
+  
+  order = orderOf(size);
+  header = HEADER(ptr);
+  header->inuse--;
+  
+  slack = num_blocks[order] - 2 * num_local[order] - num_global[order];
+  if (slack >= 2)
+    {
+      // lazy: keep it for the next request of this order
+      pushBlock(&local_list[order], ptr);
+      STATE(ptr) = LOCALFREE | order;
+      num_local[order]++;
+      buddy_stat.num_lazy_frees++;
+    }
+  else
+    {
+      freeGlobal(ptr, order);
+      
+      // no slack left, coalesce a locally free block as well
+      if (slack == 0 && local_list[order] != NULL)
+	{
+	  block = local_list[order];
+	  unlinkBlock(&local_list[order], block);
+	  STATE(block) = 0;
+	  num_local[order]--;
+	  freeGlobal(block, order);
+	}
+    }
+  
+  if (header->inuse == 0)
+    {
+      releasePage(header);
+    }
+}
+
+kma_buddy_stat_t*
+buddy_stats()
+{
+  return &buddy_stat;
+}
+
+int
+orderOf(kma_size_t size)
+{
+  int order = MINORDER;
+  
+  while (BLOCKSIZE(order) < size)
+    {
+      order++;
+    }
+  
+  return order;
+}
+
+/* Take a free block of the order, locally free ones first, splitting a
+ * larger block if there is none.
+ */
+void*
+takeBlock(int order)
+{
+  void* block;
+  
+  if (local_list[order] != NULL)
+    {
+      block = local_list[order];
+      unlinkBlock(&local_list[order], block);
+      num_local[order]--;
+    }
+  else if (global_list[order] != NULL)
+    {
+      block = global_list[order];
+      unlinkBlock(&global_list[order], block);
+      num_global[order]--;
+    }
+  else if (order == MAXORDER)
+    {
+      newPage();
+      return takeBlock(order);
+    }
+  else
+    {
+      // the upper half of the split block stays free
+      block = takeBlock(order + 1);
+      num_blocks[order + 1]--;
+      num_blocks[order] += 2;
+      pushBlock(&global_list[order], block + BLOCKSIZE(order));
+      STATE(block + BLOCKSIZE(order)) = GLOBALFREE | order;
+      num_global[order]++;
+      buddy_stat.num_splits++;
+    }
+  
+  STATE(block) = 0;
+  return block;
+}
+
+/* Free a block to the buddy system, merging it with its buddy for as
+ * long as that is globally free as a whole.
+ */
+void
+freeGlobal(void* block, int order)
+{
+  void* buddy;
+  
+  for (; order < MAXORDER; order++)
+    {
+      buddy = BASEADDR(block)
+	+ ((block - BASEADDR(block)) ^ BLOCKSIZE(order));
+      if (STATE(buddy) != (GLOBALFREE | order))
+	{
+	  break;
+	}
+      
+      unlinkBlock(&global_list[order], buddy);
+      STATE(buddy) = 0;
+      num_global[order]--;
+      num_blocks[order] -= 2;
+      num_blocks[order + 1]++;
+      buddy_stat.num_merges++;
+      
+      if (buddy < block)
+	{
+	  block = buddy;
+	}
+    }
+  
+  pushBlock(&global_list[order], block);
+  STATE(block) = GLOBALFREE | order;
+  num_global[order]++;
+}
+
+void
+pushBlock(block_t** list, void* ptr)
+{
+  block_t* block = (block_t*) ptr;
+  
+  block->prev = NULL;
+  block->next = *list;
+  if (*list != NULL)
+    {
+      (*list)->prev = block;
+    }
+  *list = block;
+}
+
+void
+unlinkBlock(block_t** list, void* ptr)
+{
+  block_t* block = (block_t*) ptr;
+  
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      *list = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+}
+
+/* Add a page to the buddy system as the largest aligned blocks that
+ * fit between its header and its end.
+ */
+void
+newPage()
+{
+  kma_page_t* page;
+  page_header_t* header;
+  int offset, order;
+  
+  if (spare_count > 0)
+    {
+      page = spare_pages[--spare_count];
+    }
+  else
+    {
+      page = get_page();
+    }
+  pages_in_use++;
+  
+  header = (page_header_t*) page->ptr;
+  memset(header, 0, sizeof(page_header_t));
+  
+  for (offset = HEADEREND; offset < PAGESIZE; offset += BLOCKSIZE(order))
+    {
+      for (order = MAXORDER; offset & (BLOCKSIZE(order) - 1); order--)
+	;
+      pushBlock(&global_list[order], page->ptr + offset);
+      STATE(page->ptr + offset) = GLOBALFREE | order;
+      num_blocks[order]++;
+      num_global[order]++;
+    }
+}
+
+/* Take the free blocks of an empty page off the free lists and give the
+ * page back, keeping a few spares while other pages are in use.
+ */
+void
+releasePage(page_header_t* header)
+{
+  void* block;
+  int offset, order;
+  
+  for (offset = HEADEREND; offset < PAGESIZE; offset += BLOCKSIZE(order))
+    {
+      block = (void*) header + offset;
+      order = STATE(block) & ORDERMASK;
+      assert(STATE(block) != 0);
+      
+      if (STATE(block) & LOCALFREE)
+	{
+	  unlinkBlock(&local_list[order], block);
+	  num_local[order]--;
+	}
+      else
+	{
+	  unlinkBlock(&global_list[order], block);
+	  num_global[order]--;
+	}
+      num_blocks[order]--;
+    }
+  
+  pages_in_use--;
+  if (pages_in_use > 0 && spare_count < SPAREPAGES)
+    {
+      spare_pages[spare_count++] = kma_page_from_addr(header);
+      return;
+    }
+  
+  free_page(kma_page_from_addr(header));
+  
+  //nothing is allocated anymore, release the spares as well
+  if (pages_in_use == 0)
+    {
+      while (spare_count > 0)
+	{
+	  free_page(spare_pages[--spare_count]);
+	}
+    }
 }
 
 #endif // KMA_LZBUD
@@ -38,6 +38,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,9 +52,61 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// a free block holds the links of its bucket's free list; allocated
+// blocks carry no header at all
+typedef struct block
+{
+  struct block* next;
+  struct block* prev;
+} block_t;
+
+// what a page is used for, found through the page number instead of a
+// block header
+typedef struct
+{
+  uint16_t index;  // log2 of the block size, LARGEINDEX for runs,
+                   // 0 if the page is not ours
+  uint16_t inuse;  // allocated blocks in the page
+} kmemusage_t;
+
+// smallest block is 16 bytes, large enough for the free list links
+#define MINBUCKET 4
+
+// enough buckets for blocks of up to 64 KB
+#define NBUCKETS 17
+
+// marks the first page of a run handed out for a request larger than
+// a page
+#define LARGEINDEX 0xffff
+
+// kmemusage entries per table page, and table pages per directory page
+#define USAGEPERPAGE (PAGESIZE / sizeof(kmemusage_t))
+#define DIRENTRIES (PAGESIZE / sizeof(kma_page_t*))
+
+#define BLOCKSIZE(index) (1 << (index))
+#define BLOCKSPERPAGE(index) (PAGESIZE >> (index))
+
 /************Global Variables*********************************************/
 
+// free blocks of each size, and how many there are
+static block_t* bucket[NBUCKETS];
+static int bucket_free[NBUCKETS];
+
+// the kmemusage table lives in pages of its own, found through a
+// directory page; both are allocated on demand
+static kma_page_t* kmemdir = NULL;
+
+// allocated blocks and runs; everything is released when it drops to 0
+static int blocks_in_use = 0;
+
 /************Function Prototypes******************************************/
+kmemusage_t* kmemsizes(kma_page_t*);
+int bucketIndex(kma_size_t);
+void fillBucket(int);
+void pushBlock(int, block_t*);
+void unlinkBlock(int, block_t*);
+void releasePage(kma_page_t*, kmemusage_t*);
+void releaseAll();
 
 /************External Declaration*****************************************/
 
@@ -61,13 +115,218 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  kma_page_t* page;
+  block_t* block;
+  int index;
+  
+  if (size > PAGESIZE)
+    {
+      // a run of pages, only its first page has a kmemusage entry
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      if (page == NULL)
+	{
+	  return NULL;
+	}
+      kmemsizes(page)->index = LARGEINDEX;
+      blocks_in_use++;
+      return page->ptr;
+    }
+  
+  index = bucketIndex(size);
+  if (bucket[index] == NULL)
+    {
+      fillBucket(index);
+    }
+  
+  block = bucket[index];
+  unlinkBlock(index, block);
+  kmemsizes(kma_page_from_addr(block))->inuse++;
+  blocks_in_use++;
+  
+  return block;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kma_page_t* page = kma_page_from_addr(ptr);
+  kmemusage_t* usage = kmemsizes(page);
+  int index = usage->index;
+  
+  blocks_in_use--;
+  
+  if (index == LARGEINDEX)
+    {
+      usage->index = 0;
+      free_pages(page);
+    }
+  else
+    {
+      assert(index >= MINBUCKET && BLOCKSIZE(index) >= size);
+      
+      pushBlock(index, (block_t*) ptr);
+      usage->inuse--;
+      
+      // keep an empty page unless its bucket has another page worth of
+      // free blocks, so a bucket hovering around a page boundary does
+      // not get and release a page on every other request
+      if (usage->inuse == 0
+	  && bucket_free[index] >= 2 * BLOCKSPERPAGE(index))
+	{
+	  releasePage(page, usage);
+	}
+    }
+  
+  if (blocks_in_use == 0)
+    {
+      releaseAll();
+    }
+}
+
+/* The kmemusage entry of a page, indexed by its page number.
+ */
+kmemusage_t*
+kmemsizes(kma_page_t* page)
+{
+  kma_page_t** dir;
+  int i = page->id / USAGEPERPAGE;
+  
+  assert(i < DIRENTRIES);
+  
+  if (kmemdir == NULL)
+    {
+      kmemdir = get_page();
+      memset(kmemdir->ptr, 0, PAGESIZE);
+    }
+  
+  dir = (kma_page_t**) kmemdir->ptr;
+  if (dir[i] == NULL)
+    {
+      dir[i] = get_page();
+      memset(dir[i]->ptr, 0, PAGESIZE);
+    }
+  
+  return (kmemusage_t*) dir[i]->ptr + page->id % USAGEPERPAGE;
+}
+
+/* Smallest bucket whose blocks hold size bytes.
+ */
+int
+bucketIndex(kma_size_t size)
+{
+  int index = MINBUCKET;
+  
+  while (BLOCKSIZE(index) < size)
+    {
+      index++;
+    }
+  
+  return index;
+}
+
+/* Dedicate a new page to a bucket and carve it into blocks, the lowest
+ * address ending up at the head of the free list.
+ */
+void
+fillBucket(int index)
+{
+  kma_page_t* page = get_page();
+  kmemusage_t* usage = kmemsizes(page);
+  int offset;
+  
+  usage->index = index;
+  usage->inuse = 0;
+  
+  for (offset = PAGESIZE - BLOCKSIZE(index); offset >= 0;
+       offset -= BLOCKSIZE(index))
+    {
+      pushBlock(index, (block_t*) (page->ptr + offset));
+    }
+}
+
+void
+pushBlock(int index, block_t* block)
+{
+  block->prev = NULL;
+  block->next = bucket[index];
+  if (bucket[index] != NULL)
+    {
+      bucket[index]->prev = block;
+    }
+  bucket[index] = block;
+  bucket_free[index]++;
+}
+
+void
+unlinkBlock(int index, block_t* block)
+{
+  if (block->prev != NULL)
+    {
+      block->prev->next = block->next;
+    }
+  else
+    {
+      bucket[index] = block->next;
+    }
+  if (block->next != NULL)
+    {
+      block->next->prev = block->prev;
+    }
+  bucket_free[index]--;
+}
+
+/* Take the blocks of an empty page off its free list and give the page
+ * back.
+ */
+void
+releasePage(kma_page_t* page, kmemusage_t* usage)
+{
+  int index = usage->index;
+  int offset;
+  
+  for (offset = 0; offset < PAGESIZE; offset += BLOCKSIZE(index))
+    {
+      unlinkBlock(index, (block_t*) (page->ptr + offset));
+    }
+  
+  usage->index = 0;
+  free_page(page);
+}
+
+/* Nothing is allocated any more: every page left on a free list is
+ * empty. Release them together with the kmemusage table.
+ */
+void
+releaseAll()
+{
+  kma_page_t** dir;
+  kma_page_t* page;
+  int index, i;
+  
+  for (index = MINBUCKET; index < NBUCKETS; index++)
+    {
+      while (bucket[index] != NULL)
+	{
+	  page = kma_page_from_addr(bucket[index]);
+	  releasePage(page, kmemsizes(page));
+	}
+    }
+  
+  if (kmemdir == NULL)
+    {
+      return;
+    }
+  
+  dir = (kma_page_t**) kmemdir->ptr;
+  for (i = 0; i < DIRENTRIES; i++)
+    {
+      if (dir[i] != NULL)
+	{
+	  free_page(dir[i]);
+	}
+    }
+  free_page(kmemdir);
+  kmemdir = NULL;
 }
 
 #endif // KMA_MCK2
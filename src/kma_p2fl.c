@@ -43,6 +43,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 
 /************Private include**********************************************/
@@ -57,16 +59,109 @@
  */
 #define MINBLOCKSIZE 16
 
+//buffer sizes are multiples of MINBLOCKSIZE. The buffer size (class) of
+//a request is looked up by its number of MINBLOCKSIZE granules in a table
+//the compiler fills in from CLASS. By default the sizes are the powers of
+//two from MINBLOCKSIZE up to a page of 64 KB; with -DP2FL_FINECLASSES
+//there are four sizes per doubling above 64 bytes (80, 96, 112, 128, 160,
+//...), which waste at most a fifth of a buffer instead of a half.
+#ifdef P2FL_FINECLASSES
+#define NUMBERSIZE 44
+#define CLASS(size) ((size) <= 64 ? ((size) + 15) / 16 - ((size) > 0) \
+    : 4 + (25 - __builtin_clz((size) - 1)) * 4 + ((((size) - 1) >> (29 - __builtin_clz((size) - 1))) & 3))
+#define CLASSSIZE(class) ((class) < 4 ? 16 * ((class) + 1) \
+    : (1 << ((class) / 4 + 5)) + ((class) % 4 + 1) * (1 << ((class) / 4 + 3)))
+#else
+#define NUMBERSIZE 13
+#define CLASS(size) ((size) <= MINBLOCKSIZE ? 0 : 28 - __builtin_clz((size) - 1))
+#define CLASSSIZE(class) (MINBLOCKSIZE << (class))
+#endif
+
+//one entry per number of granules up to a page of 64 KB
+#define C1(i) CLASS((i) * MINBLOCKSIZE),
+#define C2(i) C1(i) C1((i) + 1)
+#define C4(i) C2(i) C2((i) + 2)
+#define C8(i) C4(i) C4((i) + 4)
+#define C16(i) C8(i) C8((i) + 8)
+#define C32(i) C16(i) C16((i) + 16)
+#define C64(i) C32(i) C32((i) + 32)
+#define C128(i) C64(i) C64((i) + 64)
+#define C256(i) C128(i) C128((i) + 128)
+#define C512(i) C256(i) C256((i) + 256)
+#define C1024(i) C512(i) C512((i) + 512)
+#define C2048(i) C1024(i) C1024((i) + 1024)
+#define C4096(i) C2048(i) C2048((i) + 2048)
+
+//largest batch of pages taken from the page layer at once
+#define MAXREFILL 16
+
+//a free buffer holds the link to the next free buffer of its page; an
+//allocated buffer carries no header at all
 typedef struct bufferT
 {
-    kma_size_t size;
-    struct bufferT* next_size; //link to the next size header
-    struct bufferT* next_buffer; // link to the next free buffer
-    kma_page_t* page; //indicate which page the buffer is belong to
+    struct bufferT* next_buffer;
 } buffer_t;
 
+//what a buffer header used to say, once per page: the buffer size of the
+//page, the bytes in use, the page's free buffers and its place on the
+//list of pages of its size that have free buffers (by page number, -1
+//ends the list). Kept off the page, by page number, so every byte of the
+//page goes to buffers. A new page is not carved up front: the buffers
+//from offset bump on have never been handed out and are not on the list.
+//The entries live in table pages from the page layer.
+typedef struct
+{
+    kma_size_t size;
+    kma_size_t used;
+    kma_size_t bump;
+    buffer_t* next_buffer;
+    int next_page;
+    int prev_page;
+} page_info_t;
+
+typedef struct
+{
+    kma_size_t size;
+    int next_page; //pages of this size with free buffers
+} size_header_t;
+
+//a table page of page_info_t and the pages with buffers it describes;
+//it is taken with the first of them and given back with the last
+typedef struct
+{
+    page_info_t* infos;
+    int pages;
+} info_dir_t;
+
+#define INFOPERPAGE (PAGESIZE / sizeof(page_info_t))
+#define INFO(id) (&info_dir[(id) / INFOPERPAGE].infos[(id) % INFOPERPAGE])
+
 /************Global Variables*********************************************/
-static buffer_t* buffer_entry = NULL;
+static const uint8_t size_class[65536 / MINBLOCKSIZE + 1] = { C4096(0) C1(4096) };
+
+//the size headers sit at the start of a control page from the page
+//layer, followed by the directory of the table pages as long as it fits;
+//a directory reaching beyond that moves to a run of its own
+static kma_page_t* control_page = NULL;
+static size_header_t* size_list = NULL;
+static info_dir_t* info_dir;
+static int info_entries;
+static kma_page_t* info_dir_run = NULL;
+
+//the address of page number 0 of the pool
+static void* pool_base = NULL;
+
+//pages holding buffers
+static int pages_in_use = 0;
+
+//empty pages kept for the next make_buffers instead of being released,
+//plus the rest of the last refill batch
+static kma_page_t* spare_pages[MAXREFILL];
+static int spare_count = 0;
+
+//size of the next refill batch, doubled whenever the spares run dry
+//and halved whenever a page comes back
+static int refill_pages = 1;
 
 /************Function Prototypes******************************************/
 
@@ -76,11 +171,25 @@ void init_buffer_list(void);
 
 void* alloc_block(kma_size_t);
 
-buffer_t* make_buffers(kma_size_t);
+size_header_t* find_size(kma_size_t);
+
+kma_page_t* take_page(void);
+
+void put_page(kma_page_t* page);
+
+int make_buffers(size_header_t*);
+
+void link_page(size_header_t*, int);
 
-int last_buf(buffer_t* size_buf, kma_page_t* page);
+void unlink_page(size_header_t*, int);
 
-void free_page_from_sizelist(buffer_t* size_buf, kma_page_t* page);
+void free_page_from_sizelist(size_header_t*, int);
+
+bool is_full(page_info_t*);
+
+page_info_t* new_info(int);
+
+void grow_info_dir(int);
 
 /************External Declaration*****************************************/
 
@@ -89,172 +198,236 @@ void free_page_from_sizelist(buffer_t* size_buf, kma_page_t* page);
 void*
 kma_malloc(kma_size_t size)
 {
-    if(buffer_entry == NULL)
+    if(size_list == NULL)
       init_buffer_list();
     return alloc_block(size);
 }
 
-/* Go through header_list until apporiated size is found. Then find first buffer_t
- * on free list, take it off free list and return its ptr + sizeof(buffer_t*)
+/* Go through size_list until apporiated size is found. Then take a free
+ * buffer of the first page of that size with free buffers and return it
  */
 void* alloc_block(kma_size_t size)
 {
-    int test_size = MINBLOCKSIZE;
-    buffer_t* top = buffer_entry;
-    top = top -> next_size;
-    while(test_size <= PAGESIZE)
+    size_header_t* top;
+    buffer_t* buf;
+
+    if(size > PAGESIZE)
+        return NULL;
+    top = find_size(size);
+
+    int id = top->next_page;
+    if(id < 0)
+        id = make_buffers(top);
+    page_info_t* page = INFO(id);
+
+    //buffers that came back first, then the next one never used
+    if(page->next_buffer != NULL)
     {
-        if(test_size >= (size + sizeof(buffer_t))){
-          buffer_t* buf = top->next_buffer;
-          if(buf == NULL)
-            buf = make_buffers(top->size);
-
-          top->next_buffer = buf->next_buffer;
-          //when the buffer is allocated, the pointer point to the size header
-          buf->next_buffer = top; 
-          ((buffer_t*)(buf->page->ptr))->size += test_size;
-          return ((void*)buf + sizeof(buffer_t));
-        }
-          
-        test_size *= 2;
-        top = top->next_size;
+        buf = page->next_buffer;
+        page->next_buffer = buf->next_buffer;
     }
-    return NULL;
+    else
+    {
+        buf = pool_base + (long)id * PAGESIZE + page->bump;
+        page->bump += top->size;
+    }
+    page->used += top->size;
+
+    //a full page leaves the list until a buffer comes back
+    if(is_full(page))
+        unlink_page(top, id);
+    return buf;
 }
 
-void init_buffer_list(void)
+//the size header of the smallest buffer that holds size, up to a page
+size_header_t* find_size(kma_size_t size)
 {
-    kma_page_t* page = get_page();
-    buffer_entry = page->ptr;
-
-    int offset = sizeof(buffer_t);
-
-    buffer_entry->next_buffer = page->ptr + offset;
-    buffer_entry->page = page;
-    buffer_entry->size = 0;
+    return &size_list[size_class[(size + MINBLOCKSIZE - 1) / MINBLOCKSIZE]];
+}
 
-    buffer_t* current = buffer_entry;
-    offset += sizeof(buffer_t);
-    int size = MINBLOCKSIZE;
-    while(size <= PAGESIZE)
+/* Take a spare page, refilling the spares with a batch sized by the
+ * recent demand when there are none left.
+ */
+kma_page_t* take_page(void)
+{
+    if(spare_count == 0)
     {
-        current->next_size = page->ptr + offset;
-        current = current->next_size;
-        current->next_buffer = NULL;
-        current->size = size;
-        current->page = page;
-        size *= 2;
-        offset += sizeof(buffer_t);
+        spare_count = get_pages_batch(refill_pages, spare_pages);
+        if(spare_count == 0)
+            return get_page();
+        if(refill_pages < MAXREFILL)
+            refill_pages *= 2;
     }
-    current->next_size = NULL;
+    return spare_pages[--spare_count];
 }
 
-buffer_t* make_buffers(kma_size_t size)
+//keep the page as a spare if there is room
+void put_page(kma_page_t* page)
 {
-    kma_page_t* page = get_page();
-    if(page == NULL)
-        return NULL;
+    if(refill_pages > 1)
+        refill_pages /= 2;
+    if(spare_count < SPAREPAGES)
+        spare_pages[spare_count++] = page;
+    else
+        free_page(page);
+}
 
-    buffer_entry->next_buffer->size++;
-    buffer_t* top = page->ptr;
+void init_buffer_list(void)
+{
+    int i;
 
-    top->next_size = NULL;
-    top->size = 0;
-    top->page = page;
-    int offset = size;
-    buffer_t* current;
+    control_page = get_page();
+    size_list = control_page->ptr;
+    info_dir = (info_dir_t*)(size_list + NUMBERSIZE);
+    info_entries = (PAGESIZE - NUMBERSIZE * sizeof(size_header_t)) / sizeof(info_dir_t);
+    memset(info_dir, 0, info_entries * sizeof(info_dir_t));
 
-    while(offset < PAGESIZE)
+    for(i = 0; i < NUMBERSIZE; i++)
     {
-        current = page->ptr + offset;
-        top->next_buffer = current;
-        top = current;
-        offset += size;
-        current->next_size = NULL;
-        current->size = size;
-        current->page = page;
+        size_list[i].size = CLASSSIZE(i) <= PAGESIZE ? CLASSSIZE(i) : 0;
+        size_list[i].next_page = -1;
     }
-    top->next_buffer = NULL;
-    return (buffer_t *) page->ptr;
+}
+
+/* A new page of buffers of the size on the list of pages of that size
+ * with free buffers; returns its page number. Its buffers are handed out
+ * in address order by the bump offset, nothing is written to the page.
+ */
+int make_buffers(size_header_t* size_header)
+{
+    kma_page_t* page = take_page();
+    kma_size_t size = size_header->size;
+
+    pool_base = page->ptr - (long)page->id * PAGESIZE;
+    pages_in_use++;
+
+    page_info_t* info = new_info(page->id);
+    info->size = size;
+    info->used = 0;
+    info->bump = 0;
+    info->next_buffer = NULL;
+
+    link_page(size_header, page->id);
+    return page->id;
+}
+
+//the entry of a page that gets buffers, bringing in its table page
+page_info_t* new_info(int id)
+{
+    if(id / INFOPERPAGE >= info_entries)
+        grow_info_dir(id / INFOPERPAGE + 1);
+
+    info_dir_t* entry = &info_dir[id / INFOPERPAGE];
+    if(entry->pages++ == 0)
+        entry->infos = get_page()->ptr;
+    return INFO(id);
+}
+
+//move the directory to a run with room for at least entries
+void grow_info_dir(int entries)
+{
+    int pages = (entries * sizeof(info_dir_t) + PAGESIZE - 1) / PAGESIZE;
+    kma_page_t* run = get_pages(pages);
+
+    if(run == NULL)
+        error("unable to allocate", "the KMA_P2FL page table directory");
+    memcpy(run->ptr, info_dir, info_entries * sizeof(info_dir_t));
+    memset(run->ptr + info_entries * sizeof(info_dir_t), 0,
+           pages * PAGESIZE - info_entries * sizeof(info_dir_t));
+    if(info_dir_run != NULL)
+        free_pages(info_dir_run);
+
+    info_dir_run = run;
+    info_dir = run->ptr;
+    info_entries = pages * PAGESIZE / sizeof(info_dir_t);
+}
+
+//no buffer came back and the rest of the page holds no more buffers
+bool is_full(page_info_t* page)
+{
+    return page->next_buffer == NULL && page->bump + page->size > PAGESIZE;
+}
+
+void link_page(size_header_t* size_header, int id)
+{
+    INFO(id)->prev_page = -1;
+    INFO(id)->next_page = size_header->next_page;
+    if(size_header->next_page >= 0)
+        INFO(size_header->next_page)->prev_page = id;
+    size_header->next_page = id;
+}
+
+void unlink_page(size_header_t* size_header, int id)
+{
+    page_info_t* page = INFO(id);
+
+    if(page->prev_page >= 0)
+        INFO(page->prev_page)->next_page = page->next_page;
+    else
+        size_header->next_page = page->next_page;
+    if(page->next_page >= 0)
+        INFO(page->next_page)->prev_page = page->prev_page;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-    buffer_t* buf;
+    buffer_t* buf = (buffer_t*) ptr;
 
-    //retrace to the buffer header
-    buf = (buffer_t*)(ptr - sizeof(buffer_t));
+    //the page number of the buffer's page, and from it the page's size
+    int id = (BASEADDR(ptr) - pool_base) / PAGESIZE;
+    page_info_t* page = INFO(id);
+    size_header_t* size_header = find_size(page->size);
 
-    //retrace to the size header
-    buffer_t* size_header = buf->next_buffer;
+    //a full page has a free buffer again
+    if(is_full(page))
+        link_page(size_header, id);
 
-    //connect the size header to the buffer header
-    buf->next_buffer = size_header->next_buffer;
-    size_header->next_buffer = buf;
+    //connect the page to the buffer
+    buf->next_buffer = page->next_buffer;
+    page->next_buffer = buf;
 
-    ((buffer_t*)(buf->page->ptr))->size -= size_header->size;
+    page->used -= page->size;
     
-    //if this is the last free buffer in the buffer list
-    //if(last_buf(size_header, buf->page))
-    if(((buffer_t*)(buf->page->ptr))->size == 0)
+    //if this is the last buffer in use in the page
+    if(page->used == 0)
         //free the page associated with the particular size header
-        free_page_from_sizelist(size_header, buf->page);
-    //if no available buffer in the array  
-    if(!buffer_entry->next_buffer->size)
+        free_page_from_sizelist(size_header, id);
+    //if no page is in use anymore
+    if(!pages_in_use)
         //remove the buffer list
         remove_buffer_list();
 }
 
-int last_buf(buffer_t* size_header, kma_page_t* page)
+//the page and its free buffers leave the size's list at once, and the
+//table page once it describes no page with buffers
+void free_page_from_sizelist(size_header_t* size_header, int id)
 {
-    buffer_t* buf = size_header->next_buffer;
-    //by counting all the avaialbe free buffer size
-    kma_size_t used_sofar = 0;
+    info_dir_t* entry = &info_dir[id / INFOPERPAGE];
 
-    while(buf != NULL)
-    {
-        if(buf->page == page)
-          used_sofar += size_header->size;
-        buf = buf->next_buffer;
-    }
-    //if it equal to page size, then means no buffer is used
-    if (used_sofar == PAGESIZE)
-      return 1;
-    return 0;
-}
+    unlink_page(size_header, id);
+    pages_in_use--;
+    put_page(kma_page_from_addr(pool_base + (long)id * PAGESIZE));
 
-void free_page_from_sizelist(buffer_t* size_header, kma_page_t* page)
-{
-    buffer_t* prev = size_header;
-    buffer_t* top = size_header->next_buffer;
-    //remove all the buffers in the list
-    while(top != NULL){
-      if(top->page == page)
-      {
-        while(top != NULL && top->page == page)
-            top = top->next_buffer;
-        if(top != NULL){
-          prev->next_buffer = top;
-          prev = top;
-          top = top->next_buffer;
-        }
-        else
-          prev->next_buffer = NULL;
-      }
-      else{
-        prev = top;
-        top = top->next_buffer;
-      }
+    if(--entry->pages == 0)
+    {
+        free_page(kma_page_from_addr(entry->infos));
+        entry->infos = NULL;
     }
-    buffer_entry->next_buffer->size--;
-    free_page(page);
 }
 
 void remove_buffer_list(void) {
-    free_page(buffer_entry->page);
-    buffer_entry = NULL;
+    //nothing is allocated anymore, release the spares as well
+    free_pages_batch(spare_count, spare_pages);
+    spare_count = 0;
+    refill_pages = 1;
+
+    //and the control page and directory with it
+    if(info_dir_run != NULL)
+        free_pages(info_dir_run);
+    info_dir_run = NULL;
+    free_page(control_page);
+    size_list = NULL;
 }
 
 #endif // KMA_P2FL
-
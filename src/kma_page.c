@@ -45,6 +45,10 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,15 +61,112 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+typedef struct
+{
+  kma_page_t page; // descriptor of the allocated run starting here
+  int head;        // first frame of the allocated run holding this page
+  int npages;      // free run length, kept at its first and last frame
+  int prev;        // neighbouring free runs in address order, or -1
+  int next;
+  int stack_next;  // next page on the global free page stack, or -1
+  int epoch;       // scavenger epoch in which the free run was freed
+  bool free;       // set at the first and last frame of a free run
+  bool released;   // the page was given back to the system while free
+} page_frame_t;
+
+// single pages a thread keeps for itself; half of them move to the
+// global free page stack when the cache overflows or runs dry
+#define CACHEPAGES 32
+
+// pages on the global free page stack before half of them are merged
+// back into the free runs
+#define STACKPAGES 1024
+
+typedef struct
+{
+  int count;
+  int pages[CACHEPAGES];
+  
+  // statistics not yet added to kma_page_stats
+  int num_requested;
+  int num_freed;
+  int num_cache_hits;
+  
+  bool registered;
+} page_cache_t;
+
+// frame index of a pool address and the address of a frame
+#define FRAME(x) ((int)(((void*)(x) - pool) / PAGESIZE))
+#define FRAMEADDR(i) (pool + (size_t)(i) * PAGESIZE)
+
+// the global free page stack head packs the top frame index + 1 (0 if
+// empty) with a version tag that changes on every update, so a pop
+// racing with a pop/push of the same frame fails its compare-and-swap
+#define STACKTOP(x) ((int)((x) & 0xffffffff) - 1)
+#define STACKHEAD(top, x) (((((x) >> 32) + 1) << 32) | (uint32_t)((top) + 1))
+
+// free runs idle for this many scavenger periods are given back to the
+// system, overridable through the KMA_SCAVENGE_AGE environment variable
+#define SCAVENGEAGE 2
+
+// MADV_DONTNEED drops the pages at once; MADV_FREE would let the kernel
+// take them lazily under memory pressure
+#define SCAVENGEADVICE MADV_DONTNEED
+
+#define STATADD(field, n) \
+  __atomic_fetch_add(&kma_page_stats.field, (n), __ATOMIC_RELAXED)
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { .page_size = PAGESIZE };
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static size_t pool_bytes = 0;
+// one frame per pool page, reserved along with the pool
+static page_frame_t* frames = NULL;
+// frames at or above the break have never been handed out
+static int pool_brk = 0;
+// empty pages kept resident above the break before trimming
+static int retain_pages = RETAINPAGES;
+// lowest free run below the break
+static int free_runs = -1;
+
+// everything but the thread caches and the free page stack is
+// protected by the pool lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t page_stack = 0;
+static int stack_count = 0;
+
+// released pages inside the break, and the scavenger clock
+static int num_released = 0;
+static int scavenge_epoch = 0;
+static int scavenge_age = SCAVENGEAGE;
+
+static __thread page_cache_t page_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+int cachePop();
+void cachePush(int);
+void flushCache(page_cache_t*);
+void releaseCache(void*);
+void createCacheKey();
+void pushPages(int*, int);
+int popPage();
+void drainStack(int);
+void* scavengeMain(void*);
+void releaseRun(int, int);
+kma_page_t* claimRun(int, int);
+int allocRun(int);
+int bumpRun(int);
+void freeRun(int, int);
+void insertRun(int, int);
+void tagRun(int, int);
+void replaceRun(int, int);
+void unlinkRun(int);
+bool growPages(int);
+void trimPages();
 void initPages();
 
 /************External Declaration*****************************************/
@@ -75,34 +176,208 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+  return get_pages(1);
+}
+
+kma_page_t*
+get_pages(int n)
+{
   kma_page_t* res;
+  int i;
+  
+  assert(n > 0);
+  
+  if (n == 1 && (i = cachePop()) >= 0)
+    {
+      // the frame still describes the page from its last use
+      page_cache.num_requested++;
+      page_cache.num_cache_hits++;
+      return &frames[i].page;
+    }
+  
+  pthread_mutex_lock(&pool_lock);
+  
+  i = allocRun(n);
+  if (i < 0 && stack_count > 0)
+    {
+      drainStack(-1);
+      i = allocRun(n);
+    }
+  
+  if (i < 0)
+    {
+      pthread_mutex_unlock(&pool_lock);
+      if (n == 1)
+	{
+	  error("error: all pages already allocated", "");
+	}
+      return NULL;
+    }
+  
+  if (n > 1)
+    {
+      kma_page_stats.num_runs_requested++;
+      kma_page_stats.num_runs_in_use++;
+    }
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  // the boundary tags change under the lock, or a run freed next to this
+  // one may still see it free and merge with it
+  res = claimRun(i, n);
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  pthread_mutex_unlock(&pool_lock);
   
-  assert(res->ptr != NULL);
+  STATADD(num_requested, n);
+  STATADD(num_in_use, n);
   
-  return res;	
+  return res;
+}
+
+int
+get_pages_batch(int n, kma_page_t* out[])
+{
+  int i, got, run;
+  
+  assert(n > 0);
+  
+  pthread_mutex_lock(&pool_lock);
+  
+  // one run split into single pages if there is a large enough one,
+  // otherwise whatever runs first fit finds, lowest address first
+  got = 0;
+  run = n;
+  while (got < n)
+    {
+      i = allocRun(run);
+      if (i < 0 && stack_count > 0)
+	{
+	  drainStack(-1);
+	  i = allocRun(run);
+	}
+      if (i < 0)
+	{
+	  if (run == 1)
+	    {
+	      break;
+	    }
+	  run = 1;
+	  continue;
+	}
+      
+      for (; run > 0; run--, i++)
+	{
+	  out[got++] = claimRun(i, 1);
+	}
+      run = 1;
+    }
+  
+  pthread_mutex_unlock(&pool_lock);
+  
+  STATADD(num_requested, got);
+  STATADD(num_in_use, got);
+  
+  return got;
 }
 
 void
 free_page(kma_page_t* ptr)
 {
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(ptr == &frames[FRAME(ptr->ptr)].page);
+  
+  n = ptr->size / kma_page_stats.page_size;
+  assert(n > 0 && ptr->size == n * kma_page_stats.page_size);
+  
+  if (n == 1)
+    {
+      page_cache.num_freed++;
+      cachePush(ptr->id);
+      return;
+    }
+  
+  STATADD(num_freed, n);
+  STATADD(num_in_use, -n);
+  
+  pthread_mutex_lock(&pool_lock);
+  kma_page_stats.num_runs_freed++;
+  kma_page_stats.num_runs_in_use--;
+  freeRun(ptr->id, n);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+free_pages_batch(int n, kma_page_t* in[])
+{
+  int i;
+  
+  if (n == 0)
+    {
+      return;
+    }
+  
+  STATADD(num_freed, n);
+  STATADD(num_in_use, -n);
+  
+  // straight back into the free runs, where neighbouring pages of the
+  // batch merge again
+  pthread_mutex_lock(&pool_lock);
+  for (i = 0; i < n; i++)
+    {
+      assert(in[i] == &frames[FRAME(in[i]->ptr)].page);
+      assert(in[i]->size == kma_page_stats.page_size);
+      freeRun(in[i]->id, 1);
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* Hand out frames [i, i + n) as one allocated run.
+ */
+kma_page_t*
+claimRun(int i, int n)
+{
+  kma_page_t* res;
+  int j;
+  
+  // every page of the run maps back to its head, and none of them may
+  // look like the boundary of a free run any more
+  for (j = i; j < i + n; j++)
+    {
+      frames[j].head = i;
+      frames[j].free = FALSE;
+      if (frames[j].released)
+	{
+	  // faulted back in on first use
+	  frames[j].released = FALSE;
+	  __atomic_sub_fetch(&num_released, 1, __ATOMIC_RELAXED);
+	}
+    }
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  res = &frames[i].page;
+  res->id = i;
+  res->size = n * kma_page_stats.page_size;
+  res->ptr = FRAMEADDR(i);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  return res;
+}
+
+kma_page_t*
+kma_page_from_addr(void* ptr)
+{
+  if (pool == NULL || ptr < pool
+      || ptr >= FRAMEADDR(__atomic_load_n(&pool_brk, __ATOMIC_RELAXED)))
+    {
+      return NULL;
+    }
+  
+  return &frames[frames[FRAME(ptr)].head].page;
 }
 
 kma_page_stat_t*
@@ -110,71 +385,676 @@ page_stats()
 {
   static kma_page_stat_t stats;
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  flushCache(&page_cache);
+  
+  pthread_mutex_lock(&pool_lock);
+  kma_page_stats.num_resident = kma_page_stats.num_touched
+    - __atomic_load_n(&num_released, __ATOMIC_RELAXED);
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  pthread_mutex_unlock(&pool_lock);
+  
+  return &stats;
+}
+
+void
+scavenge_pages()
+{
+  int i;
+  
+  pthread_mutex_lock(&pool_lock);
+  
+  // pages parked on the free page stack age along with the free runs
+  drainStack(-1);
+  
+  scavenge_epoch++;
+  for (i = free_runs; i >= 0; i = frames[i].next)
+    {
+      if (scavenge_epoch - frames[i].epoch >= scavenge_age)
+	{
+	  releaseRun(i, frames[i].npages);
+	}
+    }
+  
+  pthread_mutex_unlock(&pool_lock);
 }
 
 void*
-allocPage()
+scavengeMain(void* arg)
+{
+  struct timespec period;
+  int ms = *((int*) arg);
+  
+  period.tv_sec = ms / 1000;
+  period.tv_nsec = (ms % 1000) * 1000000L;
+  
+  for (;;)
+    {
+      nanosleep(&period, NULL);
+      scavenge_pages();
+    }
+  
+  return NULL;
+}
+
+/* Give the pages of free run [i, i + n) that are still resident back to
+ * the system. Called with the pool lock held, so none of them can be
+ * handed out meanwhile.
+ */
+void
+releaseRun(int i, int n)
+{
+  int j, k;
+  
+  for (j = i; j < i + n; j = k)
+    {
+      if (frames[j].released)
+	{
+	  k = j + 1;
+	  continue;
+	}
+      
+      for (k = j; k < i + n && !frames[k].released; k++)
+	{
+	  frames[k].released = TRUE;
+	}
+      
+      if (madvise(FRAMEADDR(j), (size_t) (k - j) * PAGESIZE, SCAVENGEADVICE))
+	{
+	  // e.g. a partial explicit huge page; leave the pages resident
+	  for (; j < k; j++)
+	    {
+	      frames[j].released = FALSE;
+	    }
+	  continue;
+	}
+      
+      __atomic_add_fetch(&num_released, k - j, __ATOMIC_RELAXED);
+      kma_page_stats.num_scavenged += k - j;
+    }
+}
+
+/* Take a single page from the calling thread's cache, refilling it
+ * from the global free page stack.
+ */
+int
+cachePop()
+{
+  page_cache_t* cache = &page_cache;
+  int i;
+  
+  if (cache->count == 0)
+    {
+      while (cache->count < CACHEPAGES / 2 && (i = popPage()) >= 0)
+	{
+	  cache->pages[cache->count++] = i;
+	}
+      flushCache(cache);
+    }
+  
+  if (cache->count == 0)
+    {
+      return -1;
+    }
+  
+  return cache->pages[--cache->count];
+}
+
+void
+cachePush(int i)
+{
+  page_cache_t* cache = &page_cache;
+  
+  if (!cache->registered)
+    {
+      // hand the cache back when the thread exits
+      pthread_once(&cache_once, createCacheKey);
+      pthread_setspecific(cache_key, cache);
+      cache->registered = TRUE;
+    }
+  
+  if (cache->count == CACHEPAGES)
+    {
+      cache->count -= CACHEPAGES / 2;
+      pushPages(cache->pages + cache->count, CACHEPAGES / 2);
+      flushCache(cache);
+    }
+  
+  cache->pages[cache->count++] = i;
+}
+
+void
+flushCache(page_cache_t* cache)
+{
+  if (cache->num_requested != 0 || cache->num_freed != 0)
+    {
+      STATADD(num_requested, cache->num_requested);
+      STATADD(num_freed, cache->num_freed);
+      STATADD(num_in_use, cache->num_requested - cache->num_freed);
+      STATADD(num_cache_hits, cache->num_cache_hits);
+      cache->num_requested = 0;
+      cache->num_freed = 0;
+      cache->num_cache_hits = 0;
+    }
+}
+
+void
+releaseCache(void* ptr)
+{
+  page_cache_t* cache = (page_cache_t*) ptr;
+  
+  flushCache(cache);
+  pushPages(cache->pages, cache->count);
+  cache->count = 0;
+}
+
+void
+createCacheKey()
+{
+  pthread_key_create(&cache_key, releaseCache);
+}
+
+/* Push n pages onto the global free page stack with a single
+ * compare-and-swap, linking them up front.
+ */
+void
+pushPages(int* pages, int n)
+{
+  uint64_t head, next;
+  int i, count;
+  
+  if (n == 0)
+    {
+      return;
+    }
+  
+  for (i = 0; i < n - 1; i++)
+    {
+      frames[pages[i]].stack_next = pages[i + 1];
+    }
+  
+  head = __atomic_load_n(&page_stack, __ATOMIC_RELAXED);
+  do
+    {
+      __atomic_store_n(&frames[pages[n - 1]].stack_next, STACKTOP(head),
+		       __ATOMIC_RELAXED);
+      next = STACKHEAD(pages[0], head);
+    }
+  while (!__atomic_compare_exchange_n(&page_stack, &head, next, TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  
+  count = __atomic_add_fetch(&stack_count, n, __ATOMIC_RELAXED);
+  if (count > STACKPAGES)
+    {
+      pthread_mutex_lock(&pool_lock);
+      drainStack(STACKPAGES / 2);
+      pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+int
+popPage()
 {
-  void* res;
+  uint64_t head, next;
+  int top;
+  
+  head = __atomic_load_n(&page_stack, __ATOMIC_ACQUIRE);
+  do
+    {
+      top = STACKTOP(head);
+      if (top < 0)
+	{
+	  return -1;
+	}
+      // the frame may be popped and reused concurrently, the tag makes
+      // the exchange fail in that case
+      next = STACKHEAD(__atomic_load_n(&frames[top].stack_next,
+				       __ATOMIC_RELAXED), head);
+    }
+  while (!__atomic_compare_exchange_n(&page_stack, &head, next, TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  
+  __atomic_sub_fetch(&stack_count, 1, __ATOMIC_RELAXED);
+  
+  return top;
+}
+
+/* Merge up to n pages (all if n < 0) from the global free page stack
+ * back into the free runs. Called with the pool lock held.
+ */
+void
+drainStack(int n)
+{
+  int i;
+  
+  while (n-- != 0 && (i = popPage()) >= 0)
+    {
+      freeRun(i, 1);
+    }
+}
+
+int
+allocRun(int n)
+{
+  int i, rest;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  // first fit in address order keeps the low end of the pool dense
+  for (i = free_runs; i >= 0; i = frames[i].next)
+    {
+      if (frames[i].npages >= n)
+	{
+	  break;
+	}
+    }
+  
+  if (i < 0 && n > 1 && stack_count > 0)
+    {
+      // cached single pages may merge into a large enough run before
+      // the pool has to grow
+      drainStack(-1);
+      return allocRun(n);
+    }
   
-  if (res == NULL)
+  if (i < 0)
     {
-      error("error: all pages already allocated", "");
+      return bumpRun(n);
     }
   
-  next_free_page = *((void**)next_free_page);
+  STATADD(num_cache_hits, n);
+  kma_page_stats.num_free_pages -= n;
   
-  assert(res != NULL);
+  if (frames[i].npages == n)
+    {
+      unlinkRun(i);
+      kma_page_stats.num_free_runs--;
+    }
+  else
+    {
+      // split, the remainder takes the place of the run in the list
+      rest = i + n;
+      replaceRun(i, rest);
+      tagRun(rest, frames[i].npages - n);
+      frames[rest].epoch = frames[i].epoch;
+    }
+  
+  return i;
+}
+
+int
+bumpRun(int n)
+{
+  int res = pool_brk;
+  int avail = kma_page_stats.num_committed - pool_brk;
+  int cached;
+  
+  // nothing is written to these pages until the caller uses them
+  if (avail < n && !growPages(n - avail))
+    {
+      return -1;
+    }
+  
+  // pages between the break and num_touched were retained after an
+  // earlier release and are still resident
+  cached = kma_page_stats.num_touched - pool_brk;
+  if (cached >= n)
+    {
+      STATADD(num_cache_hits, n);
+    }
+  else
+    {
+      cached = cached > 0 ? cached : 0;
+      STATADD(num_cache_hits, cached);
+      kma_page_stats.num_cache_misses += n - cached;
+      kma_page_stats.num_touched = pool_brk + n;
+    }
+  
+  pool_brk += n;
   
   return res;
 }
 
 void
-freePage(void* ptr)
+freeRun(int i, int n)
 {
-  assert(ptr != NULL);
+  insertRun(i, n);
+  
+  if (kma_page_stats.num_touched - pool_brk > retain_pages)
+    {
+      trimPages();
+    }
+}
+
+/* Return frames [i, i + n) to the free runs. The boundary tags of the
+ * neighbours tell in constant time whether the run merges with the
+ * free run below and/or above it; only a run without free neighbours
+ * has to look for its place in the address-ordered list.
+ */
+void
+insertRun(int i, int n)
+{
+  int below = -1;
+  int above = -1;
+  int head = i;
+  int prev, next;
+  
+  if (i > 0 && frames[i - 1].free)
+    {
+      below = i - frames[i - 1].npages;
+    }
+  if (i + n < pool_brk && frames[i + n].free)
+    {
+      above = i + n;
+    }
+  
+  if (i + n == pool_brk)
+    {
+      // the run borders the break, lower it instead of keeping a run
+      pool_brk = i;
+      if (below >= 0)
+	{
+	  pool_brk = below;
+	  unlinkRun(below);
+	  kma_page_stats.num_free_pages -= frames[below].npages;
+	  kma_page_stats.num_free_runs--;
+	  kma_page_stats.num_coalesced++;
+	}
+      return;
+    }
+  
+  kma_page_stats.num_free_pages += n;
+  
+  if (below >= 0 && above >= 0)
+    {
+      // the run bridges two free runs
+      unlinkRun(above);
+      tagRun(below, frames[below].npages + n + frames[above].npages);
+      head = below;
+      kma_page_stats.num_free_runs--;
+      kma_page_stats.num_coalesced += 2;
+    }
+  else if (below >= 0)
+    {
+      tagRun(below, frames[below].npages + n);
+      head = below;
+      kma_page_stats.num_coalesced++;
+    }
+  else if (above >= 0)
+    {
+      replaceRun(above, i);
+      tagRun(i, n + frames[above].npages);
+      kma_page_stats.num_coalesced++;
+    }
+  else
+    {
+      prev = -1;
+      for (next = free_runs; next >= 0 && next < i; next = frames[next].next)
+	{
+	  prev = next;
+	}
+      
+      frames[i].prev = prev;
+      frames[i].next = next;
+      if (prev >= 0)
+	{
+	  frames[prev].next = i;
+	}
+      else
+	{
+	  free_runs = i;
+	}
+      if (next >= 0)
+	{
+	  frames[next].prev = i;
+	}
+      
+      tagRun(i, n);
+      kma_page_stats.num_free_runs++;
+    }
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  // the run ages from now on, as a whole
+  frames[head].epoch = scavenge_epoch;
+}
+
+void
+tagRun(int i, int n)
+{
+  frames[i].npages = n;
+  frames[i].free = TRUE;
+  frames[i + n - 1].npages = n;
+  frames[i + n - 1].free = TRUE;
+}
+
+/* Put the free run starting at frame to in the list position of the
+ * free run starting at frame from.
+ */
+void
+replaceRun(int from, int to)
+{
+  int prev = frames[from].prev;
+  int next = frames[from].next;
   
-  if (kma_page_stats.num_in_use == 0)
+  frames[to].prev = prev;
+  frames[to].next = next;
+  if (prev >= 0)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      frames[prev].next = to;
+    }
+  else
+    {
+      free_runs = to;
+    }
+  if (next >= 0)
+    {
+      frames[next].prev = to;
     }
 }
 
+void
+unlinkRun(int i)
+{
+  int prev = frames[i].prev;
+  int next = frames[i].next;
+  
+  if (prev >= 0)
+    {
+      frames[prev].next = next;
+    }
+  else
+    {
+      free_runs = next;
+    }
+  if (next >= 0)
+    {
+      frames[next].prev = prev;
+    }
+}
+
+bool
+growPages(int n)
+{
+  int committed = kma_page_stats.num_committed;
+  int npages;
+  size_t bytes;
+  void* ptr;
+  
+  // commit whole chunks, at least n more pages
+  npages = ((n + CHUNKPAGES - 1) / CHUNKPAGES) * CHUNKPAGES;
+  if (npages > kma_page_stats.max_pages - committed)
+    {
+      npages = kma_page_stats.max_pages - committed;
+    }
+  
+  if (npages < n)
+    {
+      return FALSE;
+    }
+  
+  ptr = FRAMEADDR(committed);
+  bytes = (size_t) npages * PAGESIZE;
+  if (kma_page_stats.huge_mode == HUGE_HUGETLB)
+    {
+      if (bytes % HUGEPAGESIZE == 0
+	  && mmap(ptr, bytes, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+		  -1, 0) != MAP_FAILED)
+	{
+	  kma_page_stats.num_committed += npages;
+	  return TRUE;
+	}
+      
+      // no (more) huge pages reserved in the system; a failed fixed
+      // mapping may have dropped the reservation, so map afresh
+      kma_page_stats.huge_mode = HUGE_THP;
+      if (mmap(ptr, bytes, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	       -1, 0) == MAP_FAILED)
+	{
+	  error("Error using mmap to commit pool pages", "");
+	}
+    }
+  else if (mprotect(ptr, bytes, PROT_READ | PROT_WRITE))
+    {
+      error("Error using mprotect to commit pool pages", "");
+    }
+  
+  if (kma_page_stats.huge_mode == HUGE_THP
+      && madvise(ptr, bytes, MADV_HUGEPAGE))
+    {
+      kma_page_stats.huge_mode = HUGE_NONE;
+    }
+  
+  kma_page_stats.num_committed += npages;
+  
+  return TRUE;
+}
+
+/* Decommit the resident pages above the break once more than
+ * retain_pages of them have piled up, leaving half of them (rounded up
+ * to a chunk) so a workload swinging around the break does not fault
+ * pages in and out on every swing.
+ */
+void
+trimPages()
+{
+  int keep, i;
+  size_t bytes;
+  
+  keep = pool_brk + retain_pages / 2;
+  keep = ((keep + CHUNKPAGES - 1) / CHUNKPAGES) * CHUNKPAGES;
+  if (keep >= kma_page_stats.num_touched)
+    {
+      return;
+    }
+  
+  // replace the pages by a fresh inaccessible mapping; the reservation
+  // itself is kept
+  bytes = (size_t) (kma_page_stats.num_committed - keep) * PAGESIZE;
+  if (mmap(pool + (size_t) keep * PAGESIZE, bytes, PROT_NONE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	   -1, 0) == MAP_FAILED)
+    {
+      error("Error using mmap to decommit pool pages", "");
+    }
+  
+  // released pages above the break are gone for good now
+  for (i = keep; i < kma_page_stats.num_touched; i++)
+    {
+      if (frames[i].released)
+	{
+	  frames[i].released = FALSE;
+	  __atomic_sub_fetch(&num_released, 1, __ATOMIC_RELAXED);
+	}
+    }
+  
+  kma_page_stats.num_committed = keep;
+  kma_page_stats.num_touched = keep;
+  kma_page_stats.num_trimmed++;
+}
+
 void
 initPages()
 {
-  int i;
+  char* limit;
+  void* base;
+  size_t head;
   
-  assert(next_free_page == NULL);
+  assert(free_runs < 0);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  kma_page_stats.max_pages = MAXPAGES;
+  limit = getenv("KMA_MAXPAGES");
+  if (limit != NULL && atoi(limit) > 0)
+    {
+      kma_page_stats.max_pages = atoi(limit);
+    }
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  limit = getenv("KMA_RETAINPAGES");
+  if (limit != NULL && atoi(limit) >= 0)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
-      
-      *((void**) ptr) = next;
+      retain_pages = atoi(limit);
+    }
+  
+  kma_page_stats.huge_mode = HUGE_NONE;
+  limit = getenv("KMA_HUGEPAGES");
+  if (limit != NULL && strcmp(limit, "thp") == 0)
+    {
+      kma_page_stats.huge_mode = HUGE_THP;
+    }
+  else if (limit != NULL && strcmp(limit, "hugetlb") == 0)
+    {
+      kma_page_stats.huge_mode = HUGE_HUGETLB;
+    }
+  
+  // reserve address space only, aligned to a huge page (and thus to
+  // PAGESIZE so that BASEADDR works) so every chunk can be backed by
+  // one huge page
+  pool_bytes = (size_t) kma_page_stats.max_pages * PAGESIZE;
+  base = mmap(NULL, pool_bytes + HUGEPAGESIZE, PROT_NONE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    error("Error using mmap to reserve the page pool", "");
+  
+  head = (HUGEPAGESIZE - ((unsigned long) base & (HUGEPAGESIZE - 1)))
+    & (HUGEPAGESIZE - 1);
+  if (head > 0)
+    {
+      munmap(base, head);
+    }
+  munmap(base + head + pool_bytes, HUGEPAGESIZE - head);
+  pool = base + head;
+  pool_brk = 0;
+  
+  // the frame table is only touched where pages are handed out
+  frames = mmap(NULL, (size_t) kma_page_stats.max_pages * sizeof(page_frame_t),
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (frames == MAP_FAILED)
+    error("Error using mmap to reserve the page frame table", "");
+  
+  kma_page_stats.num_committed = 0;
+  kma_page_stats.num_touched = 0;
+  
+  limit = getenv("KMA_SCAVENGE_AGE");
+  if (limit != NULL && atoi(limit) > 0)
+    {
+      scavenge_age = atoi(limit);
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  // the scavenger thread is optional, see scavenge_pages()
+  limit = getenv("KMA_SCAVENGE_MS");
+  if (limit != NULL && atoi(limit) > 0)
+    {
+      static int period;
+      pthread_t tid;
+      
+      period = atoi(limit);
+      if (pthread_create(&tid, NULL, scavengeMain, &period) == 0)
+	{
+	  pthread_detach(tid);
+	}
+    }
 }
@@ -0,0 +1,360 @@
+/***************************************************************************
+ *  Title: Kernel Page Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Benchmark for the kernel page allocator
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the page allocator benchmark
+ *
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// pages held by P2FL at the peak of 1.trace
+#define SHORTPAGES 8
+
+#define SWINGS 1000
+
+// batches of BATCHPAGES pages taken and given back
+#define BATCHES 10000
+#define BATCHPAGES 16
+
+// get_page/free_page pairs per thread, each thread holding a window
+// of HOLDPAGES pages
+#define THREADOPS 1000000
+#define HOLDPAGES 64
+#define MAXTHREADS 16
+
+// runs of 1 to MAXRUN pages taken with get_pages in the threaded runs
+// bench, so pages split off and merge back into free runs concurrently
+#define MAXRUN 3
+
+// a peak of PEAKPAGES pages of which every KEEPEVERY-th stays allocated,
+// so the rest cannot merge back into the break
+#define PEAKPAGES 4096
+#define KEEPEVERY 64
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+double now_ns();
+long resident_kb();
+void bench_startup();
+void bench_swing();
+void bench_scavenge();
+void bench_batch();
+void bench_threads(int, int);
+void* thread_main(void*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int threads = MAXTHREADS;
+
+  if (argc > 1)
+    {
+      threads = atoi(argv[1]);
+      if (threads < 1 || threads > MAXTHREADS)
+	{
+	  printf("Usage: %s [max threads (1-%d)]\n", argv[0], MAXTHREADS);
+	  exit(0);
+	}
+    }
+
+  bench_startup();
+  bench_swing();
+  bench_scavenge();
+  bench_batch();
+  bench_threads(threads, 1);
+  bench_threads(threads, MAXRUN);
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+double
+now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+long
+resident_kb()
+{
+  long size, resident;
+  FILE* f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL || fscanf(f, "%ld %ld", &size, &resident) != 2)
+    {
+      error("unable to read", "/proc/self/statm");
+    }
+  fclose(f);
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Latency of the very first get_page() and the memory made resident by
+ * a short run holding SHORTPAGES pages.
+ */
+void
+bench_startup()
+{
+  kma_page_t* pages[SHORTPAGES];
+  long rss_before, rss_first, rss_short;
+  double start, first;
+  int i;
+
+  rss_before = resident_kb();
+
+  start = now_ns();
+  pages[0] = get_page();
+  first = now_ns() - start;
+  rss_first = resident_kb();
+
+  for (i = 1; i < SHORTPAGES; i++)
+    {
+      pages[i] = get_page();
+      *((char*) pages[i]->ptr) = 1;
+    }
+  rss_short = resident_kb();
+
+  for (i = 0; i < SHORTPAGES; i++)
+    {
+      free_page(pages[i]);
+    }
+
+  printf("first get_page:          %10.0f ns\n", first);
+  printf("resident after first:    %10ld KB\n", rss_first - rss_before);
+  printf("resident with %d pages:   %10ld KB\n", SHORTPAGES,
+	 rss_short - rss_before);
+}
+
+/* A workload swinging between empty and SHORTPAGES pages in use.
+ */
+void
+bench_swing()
+{
+  kma_page_t* pages[SHORTPAGES];
+  double start;
+  int i, j;
+
+  start = now_ns();
+  for (i = 0; i < SWINGS; i++)
+    {
+      for (j = 0; j < SHORTPAGES; j++)
+	{
+	  pages[j] = get_page();
+	  *((char*) pages[j]->ptr) = 1;
+	}
+      for (j = 0; j < SHORTPAGES; j++)
+	{
+	  free_page(pages[j]);
+	}
+    }
+
+  printf("empty/non-empty swing:   %10.0f ns\n", (now_ns() - start) / SWINGS);
+}
+
+/* Resident memory after a one-time peak, before and after the
+ * scavenger gave the idle free runs back.
+ */
+void
+bench_scavenge()
+{
+  static kma_page_t* pages[PEAKPAGES];
+  long rss_before, rss_peak, rss_freed, rss_scavenged;
+  kma_page_stat_t* stat;
+  double start;
+  int i;
+
+  rss_before = resident_kb();
+  for (i = 0; i < PEAKPAGES; i++)
+    {
+      pages[i] = get_page();
+      *((char*) pages[i]->ptr) = 1;
+    }
+  rss_peak = resident_kb();
+
+  for (i = 0; i < PEAKPAGES; i++)
+    {
+      if (i % KEEPEVERY != KEEPEVERY - 1)
+	{
+	  free_page(pages[i]);
+	}
+    }
+  rss_freed = resident_kb();
+
+  // scavenge until the free runs are old enough
+  start = now_ns();
+  for (i = 0; i < 4; i++)
+    {
+      scavenge_pages();
+    }
+  rss_scavenged = resident_kb();
+
+  printf("resident at peak:        %10ld KB\n", rss_peak - rss_before);
+  printf("resident after free:     %10ld KB\n", rss_freed - rss_before);
+  printf("resident after scavenge: %10ld KB (%.0f us)\n",
+	 rss_scavenged - rss_before, (now_ns() - start) / 1e3);
+
+  stat = page_stats();
+  printf("resident/committed:      %10d/%d pages\n", stat->num_resident,
+	 stat->num_committed);
+
+  for (i = KEEPEVERY - 1; i < PEAKPAGES; i += KEEPEVERY)
+    {
+      free_page(pages[i]);
+    }
+}
+
+/* Cost per page of taking BATCHPAGES pages one at a time and as a
+ * batch, and how many of them follow their predecessor in memory.
+ */
+void
+bench_batch()
+{
+  kma_page_t* pages[BATCHPAGES];
+  double start, single, batch;
+  int i, j, single_adjacent = 0, batch_adjacent = 0;
+
+  start = now_ns();
+  for (i = 0; i < BATCHES; i++)
+    {
+      for (j = 0; j < BATCHPAGES; j++)
+	{
+	  pages[j] = get_page();
+	  single_adjacent += j > 0
+	    && pages[j]->ptr == pages[j - 1]->ptr + PAGESIZE;
+	}
+      for (j = 0; j < BATCHPAGES; j++)
+	{
+	  free_page(pages[j]);
+	}
+    }
+  single = (now_ns() - start) / BATCHES / BATCHPAGES;
+
+  start = now_ns();
+  for (i = 0; i < BATCHES; i++)
+    {
+      if (get_pages_batch(BATCHPAGES, pages) != BATCHPAGES)
+	{
+	  error("short batch", "");
+	}
+      for (j = 1; j < BATCHPAGES; j++)
+	{
+	  batch_adjacent += pages[j]->ptr == pages[j - 1]->ptr + PAGESIZE;
+	}
+      free_pages_batch(BATCHPAGES, pages);
+    }
+  batch = (now_ns() - start) / BATCHES / BATCHPAGES;
+
+  printf("%d pages one at a time: %10.0f ns/page (%.0f%% adjacent)\n",
+	 BATCHPAGES, single, 100.0 * single_adjacent / BATCHES / (BATCHPAGES - 1));
+  printf("%d pages as a batch:    %10.0f ns/page (%.0f%% adjacent)\n",
+	 BATCHPAGES, batch, 100.0 * batch_adjacent / BATCHES / (BATCHPAGES - 1));
+}
+
+/* get_pages/free_pages throughput with 1, 2, 4, ... threads, each
+ * recycling a window of HOLDPAGES runs of 1 to max_run pages.
+ */
+void
+bench_threads(int max_threads, int max_run)
+{
+  pthread_t tids[MAXTHREADS];
+  double start, elapsed;
+  int n, i;
+
+  for (n = 1; n <= max_threads; n *= 2)
+    {
+      start = now_ns();
+      for (i = 0; i < n; i++)
+	{
+	  pthread_create(&tids[i], NULL, thread_main, (void*) (long) max_run);
+	}
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(tids[i], NULL);
+	}
+      elapsed = now_ns() - start;
+
+      printf("%2d thread(s), %d page(s):  %10.2f Mops/s\n", n, max_run,
+	     (double) n * THREADOPS / elapsed * 1e3);
+    }
+
+  if (page_stats()->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+}
+
+void*
+thread_main(void* arg)
+{
+  kma_page_t* pages[HOLDPAGES] = { NULL };
+  int max_run = (long) arg;
+  int i, slot, n;
+
+  // the first and last page of a run hold its number, so a run handed
+  // out twice or merged while in use shows up
+  for (i = 0; i < THREADOPS; i++)
+    {
+      slot = i % HOLDPAGES;
+      if (pages[slot] != NULL)
+	{
+	  assert(*((int*) pages[slot]->ptr) == i - HOLDPAGES);
+	  assert(*((int*) (pages[slot]->ptr + pages[slot]->size - PAGESIZE))
+		 == i - HOLDPAGES);
+	  free_pages(pages[slot]);
+	}
+      n = 1 + i % max_run;
+      pages[slot] = get_pages(n);
+      if (pages[slot] == NULL)
+	{
+	  error("no run of pages left", "");
+	}
+      *((int*) pages[slot]->ptr) = i;
+      *((int*) (pages[slot]->ptr + (n - 1) * PAGESIZE)) = i;
+    }
+
+  for (slot = 0; slot < HOLDPAGES; slot++)
+    {
+      free_pages(pages[slot]);
+    }
+
+  return NULL;
+}
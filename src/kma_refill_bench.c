@@ -0,0 +1,158 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Cost of bringing a new page into service in a backend
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the refill benchmark
+ *
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// pages filled per size and round; few enough that the pool keeps them
+// resident between rounds (RETAINPAGES), so the first touch of fresh
+// memory is only paid in the first round
+#define NEWPAGES 128
+
+// rounds per size, the first one only warms the pool up
+#define ROUNDS 5
+
+// allocations held at once, more than NEWPAGES pages of the smallest size
+#define MAXOBJECTS (NEWPAGES * PAGESIZE / 16)
+
+/************Global Variables*********************************************/
+
+static void* objs[MAXOBJECTS];
+static char seen[MAXPAGES];
+
+static const int sizes[] = { 24, 100, 500, 2000 };
+
+/************Function Prototypes******************************************/
+double now_ns();
+void fill(int, double*, double*, int*, int*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  double refill_ns, other_ns, sum_refill, sum_other;
+  int i, r, n_refill, n_other, tot_refill, tot_other;
+
+  printf("%6s %8s %12s %12s %14s\n", "size", "pages", "refill (ns)",
+	 "other (ns)", "per page (ns)");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      sum_refill = sum_other = 0.0;
+      tot_refill = tot_other = 0;
+      for (r = 0; r < ROUNDS; r++)
+	{
+	  fill(sizes[i], &refill_ns, &other_ns, &n_refill, &n_other);
+	  if (r == 0)
+	    {
+	      continue;
+	    }
+	  sum_refill += refill_ns;
+	  sum_other += other_ns;
+	  tot_refill += n_refill;
+	  tot_other += n_other;
+	}
+
+      printf("%6d %8d %12.0f %12.0f %14.0f\n", sizes[i],
+	     tot_refill / (ROUNDS - 1), sum_refill / tot_refill,
+	     sum_other / tot_other, (sum_refill + sum_other) / tot_refill);
+    }
+
+  if (page_stats()->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+double
+now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Allocate objects of the size until NEWPAGES pages have been brought
+ * into service, then free them all. An allocation landing on a page no
+ * earlier one did is a refill; the time of those and of the others is
+ * summed up separately.
+ */
+void
+fill(int size, double* refill_ns, double* other_ns, int* n_refill,
+     int* n_other)
+{
+  kma_page_t* page;
+  double start, elapsed;
+  int n = 0, i;
+
+  *refill_ns = *other_ns = 0.0;
+  *n_refill = *n_other = 0;
+  memset(seen, 0, sizeof(seen));
+
+  while (*n_refill < NEWPAGES && n < MAXOBJECTS)
+    {
+      start = now_ns();
+      objs[n] = kma_malloc(size);
+      elapsed = now_ns() - start;
+
+      page = kma_page_from_addr(objs[n]);
+      assert(page != NULL && page->id < MAXPAGES);
+      if (!seen[page->id])
+	{
+	  seen[page->id] = 1;
+	  *refill_ns += elapsed;
+	  (*n_refill)++;
+	}
+      else
+	{
+	  *other_ns += elapsed;
+	  (*n_other)++;
+	}
+      n++;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      kma_free(objs[i], size);
+    }
+}
@@ -38,6 +38,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
@@ -49,36 +51,99 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-typedef struct 
+//boundary tag at both ends of every block: the size of the whole block
+//(tags included) and whether it is allocated
+typedef struct
 {
+  int size;
+  int used;
+} rm_tag;
+
+typedef struct
+{
+  rm_tag tag;
+  //only valid while the block is free
   void* next;
   void* prev;
-  void* page;
-  int size;	
 } rm_block;
 
-typedef struct 
+//a free block of a large bin: the bin lists one block per size, in
+//increasing size, and the other free blocks of that size hang off it,
+//so a bin is searched in at most as many steps as it has sizes
+typedef struct
+{
+  rm_block block;
+  void* same_next;
+  //NULL for the block on the bin list
+  void* same_prev;
+} rm_large_block;
+
+typedef struct
 {
-  //int page_id;
-  void* this;
-  void* next_page;
-  void* first_free_block;
-  int page_count;
   int block_count;
-  //int max_block;	
+  //links of the list of empty pages, while the page is empty
+  void* next_page;
+  void* prev_page;
+  //an allocated footer so the first block never merges to the left;
+  //it ends the head on an 8 byte boundary, the blocks start there
+  rm_tag fence;
 } rm_page_head;
 
+//a free block has to hold its links and its footer
+#define MINBLOCK (sizeof(rm_block) + sizeof(rm_tag))
+
+//the first block of a page, and its size up to the allocated header
+//at the end of the page
+#define HEADEND (offsetof(rm_page_head, fence) + sizeof(rm_tag))
+#define FIRSTBLOCK(page) ((rm_block*)((long int)(page) + HEADEND))
+#define PAGEBLOCK (PAGESIZE - HEADEND - sizeof(rm_tag))
+
+//the largest request a page can hold
+#define MAXREQUEST (PAGEBLOCK - 2 * sizeof(rm_tag))
+
+#define FOOTER(block) ((rm_tag*)((long int)(block) + ((rm_block*)(block))->tag.size - sizeof(rm_tag)))
+
+//blocks below SMALLBINS * 8 bytes have a bin per size, larger ones
+//share a bin per SUBBINS-th of a power of two
+#define SMALLBINS 64
+#define SUBBINS 16
+#define NBINS (SMALLBINS + SUBBINS * 8)
+#define BINMAPWORDS ((NBINS + 63) / 64)
+
 /************Global Variables*********************************************/
-kma_page_t* page_entry = NULL;
+//pages in use, and the empty ones among them
+static int page_count = 0;
+static int empty_count = 0;
+static rm_page_head* empty_pages = NULL;
+
+//free blocks by size, and a bit per bin that is not empty
+static rm_block* bins[NBINS];
+static uint64_t binmap[BINMAPWORDS];
 /************Function Prototypes******************************************/
 void init_page(kma_page_t *page);
 
-void* find_first_fit(int size); 
+void* find_fit(int size);
+
+void set_tags(void* addr, int size, int used);
+
+int bin_index(int size);
+
+int next_bin(int index);
 
 void add_block (void* addr, int size);
 
+void add_large (rm_large_block* block, int index);
+
 void remove_block (void* addr);
 
+void remove_large (rm_large_block* block, int index);
+
+void add_empty (rm_page_head* page);
+
+void remove_empty (rm_page_head* page);
+
+void release_page (rm_page_head* page);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -86,110 +151,193 @@ void remove_block (void* addr);
 void*
 kma_malloc(kma_size_t size)
 {
-  //if size larger than page, return null
-  if ((size + sizeof(void *)) > PAGESIZE) {
-  	return NULL;
-  }		
-  if (page_entry == NULL) {
-  	kma_page_t* page = get_page();
-  	page_entry = page;
-  	init_page(page);
+  //too large for a page, give it pages of its own
+  if (size > MAXREQUEST) {
+	kma_page_t* run = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+	return run == NULL ? NULL : run->ptr;
+  }
+  //round up to 8 bytes and add the tags
+  int need = ((size + 7) & ~7) + 2 * sizeof(rm_tag);
+  if (need < MINBLOCK)
+	need = MINBLOCK;
+
+  rm_block* block = find_fit(need);
+  if (block == NULL) {
+	kma_page_t* new_page = get_page();
+	init_page(new_page);
+	block = find_fit(need);
+	assert(block != NULL);
+  }
+
+  //split off the rest if it can be a block of its own
+  int total = block -> tag.size;
+  remove_block(block);
+  if (total - need >= MINBLOCK) {
+	add_block((void*)((long int)block + need), total - need);
+	total = need;
   }
-  void *first_fit;
-  first_fit = find_first_fit(size);
+  set_tags(block, total, 1);
 
-  rm_page_head* page = BASEADDR(first_fit);
-  (page -> block_count) ++;
+  //the page is no longer empty
+  rm_page_head* page = BASEADDR(block);
+  if ((page -> block_count) ++ == 0)
+	remove_empty(page);
 
-  return first_fit;
+  return (void*)((long int)block + sizeof(rm_tag));
 }
 
 void
 init_page(kma_page_t *page) {
 
 	rm_page_head *pagehead;
-	*((kma_page_t**) page->ptr) = page;
+	rm_tag *end;
 
 	pagehead = (rm_page_head*) (page->ptr);
 
-	//add block ptr to pagehead
-	pagehead -> page_count = 0;
 	pagehead -> block_count = 0;
+	pagehead -> fence.size = 0;
+	pagehead -> fence.used = 1;
+
+	//an allocated header at the end so the last block never merges
+	//to the right
+	end = (rm_tag*)((long int)pagehead + PAGESIZE - sizeof(rm_tag));
+	end -> size = 0;
+	end -> used = 1;
+
+	add_block(FIRSTBLOCK(pagehead), PAGEBLOCK);
+	page_count++;
+	add_empty(pagehead);
+}
 
-	pagehead -> first_free_block = (rm_block*)((long int)pagehead + sizeof(rm_page_head));
+void
+set_tags(void* addr, int size, int used) {
+	rm_block* block = (rm_block*) addr;
 
-	add_block(((void*)(pagehead -> first_free_block)),(PAGESIZE - sizeof(rm_page_head)));
+	block -> tag.size = size;
+	block -> tag.used = used;
+	FOOTER(block) -> size = size;
+	FOOTER(block) -> used = used;
+}
+
+int
+bin_index(int size) {
+	if (size < SMALLBINS * 8)
+		return size >> 3;
 
+	int log = 31 - __builtin_clz(size);
+	return SMALLBINS + (log - 9) * SUBBINS + ((size >> (log - 4)) & (SUBBINS - 1));
 }
 
+//the first bin from index on that is not empty, or -1
+int
+next_bin(int index) {
+	int word = index / 64;
+	uint64_t bits;
+
+	if (index >= NBINS)
+		return -1;
+
+	bits = binmap[word] & (~0ULL << (index % 64));
+	while (bits == 0) {
+		if (++word == BINMAPWORDS)
+			return -1;
+		bits = binmap[word];
+	}
+	return word * 64 + __builtin_ctzll(bits);
+}
+
+/* A free block of at least size bytes. The small bins hold blocks of
+ * one size only, so any block of the size's bin or a larger bin fits; a
+ * large bin lists its sizes from the smallest, so the first block of a
+ * larger bin is the smallest one there. Best fit (-DRM_BESTFIT) looks
+ * through the sizes of the size's own large bin first. First fit only
+ * tries its smallest block, then takes a larger bin, and goes through
+ * the sizes only if no larger bin has a block.
+ */
 void*
-find_first_fit(int size) {
-	int min_size = sizeof(rm_block);
-	if (size < sizeof(rm_block))
-		size = sizeof(rm_block);
-
-	rm_page_head *mainpage;
-	//search from get the page entry
-	mainpage = (rm_page_head*) (page_entry -> ptr);
-	//int blocksize;
-	//go find the first fit
-	rm_block* tmp = ((rm_block *)(mainpage -> first_free_block));
-
-	while (tmp != NULL) {
-		if (tmp -> size < size) {
+find_fit(int size) {
+	int index = bin_index(size);
+	int next;
+	rm_block* tmp = NULL;
+
+	if (index >= SMALLBINS) {
+		tmp = bins[index];
+#ifdef RM_BESTFIT
+		while (tmp != NULL && tmp -> tag.size < size)
 			tmp = tmp -> next;
-			continue;
-		}
-		else if(tmp -> size == size || (tmp -> size - size) < min_size){
-			remove_block(tmp);
-			return ((void*)tmp);
-		}
-		else {
-			add_block((void*)((long int)tmp + size), (tmp->size - size));
-			remove_block((tmp));
-			return((void*)tmp);
-		}
+#endif
+		if (tmp != NULL && tmp -> tag.size >= size)
+			return tmp;
+		next = next_bin(index + 1);
 	}
+	else
+		next = next_bin(index);
 
-	kma_page_t* new_page = get_page();
-	
-	init_page(new_page);
-	mainpage -> page_count++;
-	return find_first_fit(size);
+	if (next >= 0)
+		return bins[next];
+
+	//at most as many steps as the bin has sizes
+	while (tmp != NULL && tmp -> tag.size < size)
+		tmp = tmp -> next;
+	return tmp;
 }
 
 void add_block (void* addr, int size) {
 
-	//set up a new block
-	((rm_block*)addr) -> size = size;
-	((rm_block*)addr) -> prev = NULL;
-
-	//start from first page
-	rm_page_head* mainpage = (rm_page_head*) page_entry -> ptr;
-	void* start = (void*) mainpage -> first_free_block;
-	//if new block is before first block
-	if (addr < start) {
-		((rm_block*)(mainpage -> first_free_block))->prev = (rm_block*)addr;
-     	((rm_block*)addr) -> next = ((rm_block*)(mainpage -> first_free_block));
-      	mainpage -> first_free_block = (rm_block*)addr;
-      	return;
-	}
-	else if (addr == start) {
-		((rm_block*)addr) -> next = NULL;
+	rm_block* block = (rm_block*) addr;
+	int index = bin_index(size);
+
+	set_tags(block, size, 0);
+
+	if (index >= SMALLBINS) {
+		add_large((rm_large_block*) block, index);
 		return;
 	}
-	else {
-		while (((rm_block*)start) -> next != NULL && start < addr) {
-			start = ((void*)(((rm_block*)start)->next));
-		}
-
-		rm_block* tmp = ((rm_block*)start) -> next;
-		if (tmp != NULL)
-			tmp -> prev = addr;
-		((rm_block*)start) -> next = addr;
-		((rm_block*)addr) -> prev = start;
-		((rm_block*)addr) -> next = tmp;
+
+	//push it on its bin
+	block -> prev = NULL;
+	block -> next = bins[index];
+	if (bins[index] != NULL)
+		bins[index] -> prev = block;
+	bins[index] = block;
+	binmap[index / 64] |= 1ULL << (index % 64);
+}
+
+//put a block on the bin list at its size, or behind the block of its
+//size if there is one already
+void add_large (rm_large_block* block, int index) {
+
+	rm_block* tmp = bins[index];
+	rm_block* prev = NULL;
+	rm_large_block* same;
+	int size = block -> block.tag.size;
+
+	while (tmp != NULL && tmp -> tag.size < size) {
+		prev = tmp;
+		tmp = tmp -> next;
 	}
+
+	if (tmp != NULL && tmp -> tag.size == size) {
+		same = (rm_large_block*) tmp;
+		block -> same_prev = same;
+		block -> same_next = same -> same_next;
+		if (same -> same_next != NULL)
+			((rm_large_block*) same -> same_next) -> same_prev = block;
+		same -> same_next = block;
+		return;
+	}
+
+	block -> same_next = NULL;
+	block -> same_prev = NULL;
+	block -> block.prev = prev;
+	block -> block.next = tmp;
+	if (prev != NULL)
+		prev -> next = block;
+	else
+		bins[index] = (rm_block*) block;
+	if (tmp != NULL)
+		tmp -> prev = block;
+	binmap[index / 64] |= 1ULL << (index % 64);
 }
 
 void remove_block (void* addr) {
@@ -197,79 +345,136 @@ void remove_block (void* addr) {
 	rm_block* ptr = (rm_block*) addr;
 	rm_block* ptr_next = ptr -> next;
 	rm_block* ptr_prev = ptr -> prev;
+	int index = bin_index(ptr -> tag.size);
 
-	//only one node 
-	if (ptr_prev == NULL && ptr_next == NULL) {
-		rm_page_head* tmp_page = page_entry -> ptr; 
-		tmp_page -> first_free_block = NULL;
-
-		page_entry = 0;
+	if (index >= SMALLBINS) {
+		remove_large((rm_large_block*) ptr, index);
 		return;
 	}
-	//if the block is the last one
-	else if (ptr_next == NULL) {
-		ptr_prev -> next = NULL;
-		return;
+
+	if (ptr_prev != NULL)
+		ptr_prev -> next = ptr_next;
+	else {
+		bins[index] = ptr_next;
+		if (ptr_next == NULL)
+			binmap[index / 64] &= ~(1ULL << (index % 64));
 	}
-	//if the block is the first one
-	else if (ptr_prev == NULL) {
-		rm_page_head* tmp_page = page_entry -> ptr; 
-		ptr_next -> prev = NULL;
-		tmp_page -> first_free_block = ptr_next;
+	if (ptr_next != NULL)
+		ptr_next -> prev = ptr_prev;
+}
+
+
+//take a block out of a large bin; the next block of its size, if any,
+//takes its place on the bin list
+void remove_large (rm_large_block* block, int index) {
+
+	rm_large_block* same = block -> same_next;
+	rm_block* ptr_next = block -> block.next;
+	rm_block* ptr_prev = block -> block.prev;
+
+	if (block -> same_prev != NULL) {
+		((rm_large_block*) block -> same_prev) -> same_next = same;
+		if (same != NULL)
+			same -> same_prev = block -> same_prev;
 		return;
 	}
-	//if the block is the middle one
-	else {
-		rm_block* tmp1 = ptr -> prev;
-		rm_block* tmp2 = ptr -> next;
 
-		tmp1 -> next = tmp2;
-		tmp2 -> prev = tmp1;
+	if (same != NULL) {
+		same -> same_prev = NULL;
+		same -> block.next = ptr_next;
+		same -> block.prev = ptr_prev;
+		if (ptr_prev != NULL)
+			ptr_prev -> next = same;
+		else
+			bins[index] = (rm_block*) same;
+		if (ptr_next != NULL)
+			ptr_next -> prev = same;
 		return;
 	}
+
+	if (ptr_prev != NULL)
+		ptr_prev -> next = ptr_next;
+	else {
+		bins[index] = ptr_next;
+		if (ptr_next == NULL)
+			binmap[index / 64] &= ~(1ULL << (index % 64));
+	}
+	if (ptr_next != NULL)
+		ptr_next -> prev = ptr_prev;
 }
 
+void add_empty (rm_page_head* page) {
 
-void
-kma_free(void* ptr, kma_size_t size)
-{
-	//printf("kma_free\n");
-  add_block(ptr, size);
-  rm_page_head* base_addr = BASEADDR(ptr);
-  base_addr -> block_count = base_addr -> block_count - 1;
+	page -> prev_page = NULL;
+	page -> next_page = empty_pages;
+	if (empty_pages != NULL)
+		empty_pages -> prev_page = page;
+	empty_pages = page;
+	empty_count++;
+}
 
-  rm_page_head* first_page = (rm_page_head*)(page_entry -> ptr);
-  int end = first_page -> page_count;
-  int run = 1;
-
-  rm_page_head* last_page;
-  for (; run; end--) {
-    last_page = (((rm_page_head*)((long int)first_page + end * PAGESIZE))); // Get Last Page
-    run = 0;
-    if(last_page -> block_count == 0){
-      run = 1;
-      
-      rm_block* tmp;
-      for(tmp = first_page -> first_free_block; tmp != NULL; tmp = tmp->next)
-		if(BASEADDR(tmp) == last_page)
-	  		remove_block(tmp);
-      
-      run = 1;      
-      if(last_page == first_page){
-		run = 0;
-		page_entry = NULL;
-      }
-
-      free_page(last_page -> this);
-      if(page_entry != NULL)
-		first_page -> page_count -= 1;
-    }
-  }
+void remove_empty (rm_page_head* page) {
+
+	rm_page_head* next = page -> next_page;
+	rm_page_head* prev = page -> prev_page;
+
+	if (prev != NULL)
+		prev -> next_page = next;
+	else
+		empty_pages = next;
+	if (next != NULL)
+		next -> prev_page = prev;
+	empty_count--;
 }
-#endif // KMA_RM
 
+//an empty page is a single free block, take it out of its bin and
+//give the page back
+void release_page (rm_page_head* page) {
 
+	remove_empty(page);
+	remove_block(FIRSTBLOCK(page));
+	page_count--;
+	free_page(kma_page_from_addr(page));
+}
 
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  if (size > MAXREQUEST) {
+	free_pages(kma_page_from_addr(ptr));
+	return;
+  }
 
+  rm_block* block = (rm_block*)((long int)ptr - sizeof(rm_tag));
+  int total = block -> tag.size;
+  rm_tag* left = (rm_tag*)((long int)block - sizeof(rm_tag));
+  rm_block* right = (rm_block*)((long int)block + total);
 
+  //coalesce with the free neighbours, found through their tags
+  if (!left -> used) {
+	block = (rm_block*)((long int)block - left -> size);
+	total += left -> size;
+	remove_block(block);
+  }
+  if (!right -> tag.used) {
+	total += right -> tag.size;
+	remove_block(right);
+  }
+  add_block(block, total);
 
+  rm_page_head* base_addr = BASEADDR(block);
+  base_addr -> block_count = base_addr -> block_count - 1;
+  if (base_addr -> block_count > 0)
+    return;
+
+  //release the page wherever it is, but keep a few empty pages as
+  //spares unless every page is empty
+  add_empty(base_addr);
+  if (empty_count == page_count) {
+    while (empty_pages != NULL)
+      release_page(empty_pages);
+  }
+  else if (empty_count > SPAREPAGES)
+    release_page(base_addr);
+}
+#endif // KMA_RM
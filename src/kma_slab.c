@@ -0,0 +1,841 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab allocator with
+ *             object caches and a magazine layer
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the slab allocator
+ *
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+#define __KSLAB_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// objects per magazine
+#define MAGSIZE 15
+
+// kinds of caches: the internal ones, object caches with magazines that
+// keep their memory until reaped, and kma_malloc's generic caches. Those
+// have no magazines and keep one empty slab only, since every object
+// held in a magazine counts as waste for kma_malloc
+enum CACHE_KIND
+  {
+    CACHE_INTERNAL,
+    CACHE_OBJECT,
+    CACHE_GENERIC
+  };
+
+// caches that can exist at the same time, including the generic ones
+#define MAXCACHES 64
+
+// a slab spans up to this many pages, as few as keep the space left
+// over below 1/WASTEFRACTION of the slab
+#define MAXSLABPAGES 8
+#define WASTEFRACTION 8
+
+// default and minimum object alignment
+#define MINALIGN sizeof(void*)
+
+// smallest generic cache; the generic caches go up in steps of 2^k and
+// 3 * 2^(k-1) to half a page, larger requests get pages of their own
+#define MINGENERIC 16
+#define MAXGENERIC (PAGESIZE / 2)
+#define NGENERIC 32
+
+typedef struct magazine
+{
+  struct magazine* next;
+  int rounds;
+  void* round[MAGSIZE];
+} magazine_t;
+
+// kept at the end of the slab's memory
+typedef struct slab
+{
+  struct slab* next;
+  struct slab* prev;
+  kma_page_t* page;
+  void* free;  // first free object
+  int inuse;   // allocated objects, including those in magazines
+} slab_t;
+
+struct kma_cache
+{
+  kma_size_t size;    // object size
+  kma_size_t align;
+  kma_size_t stride;  // distance between objects in a slab
+  kma_size_t link;    // offset of the free list link in a free object
+  void (*ctor)(void*);
+  int id;
+  unsigned int generation;  // of the id, see cpuCache
+
+  int slab_pages;     // pages per slab
+  int per_slab;       // objects per slab
+  int color_max;      // space left over in a slab, shifted in by the
+  int color_next;     // colors of successive slabs
+
+  // slabs by number of free objects, and the empty slabs kept
+  slab_t* full;
+  slab_t* partial;
+  slab_t* empty;
+  int num_empty;
+  int max_empty;
+
+  // rounds per magazine, 0 without a magazine layer
+  int magsize;
+  magazine_t* depot_full;
+  magazine_t* depot_empty;
+
+  // protects the slabs and the depot
+  pthread_mutex_t lock;
+};
+
+// a thread's magazines of one cache, and the generation of the cache id
+// they were loaded for
+typedef struct
+{
+  magazine_t* loaded;
+  magazine_t* previous;
+  unsigned int generation;
+} cpu_cache_t;
+
+#define LINK(cache, obj) (*(void**) ((obj) + (cache)->link))
+
+#define ROUNDUP(x, align) (((x) + (align) - 1) & ~((align) - 1))
+
+/************Global Variables*********************************************/
+
+// the caches by id, for the thread exit handler, and how often each id
+// has been given to a cache
+static kma_cache_t* caches[MAXCACHES];
+static unsigned int id_generation[MAXCACHES];
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// where the structures of created caches and all magazines come from;
+// neither of them has a magazine layer
+static kma_cache_t cache_cache;
+static kma_cache_t magazine_cache;
+
+// kma_malloc's caches and what is allocated through kma_malloc
+static kma_cache_t generic[NGENERIC];
+static int num_generic = 0;
+static int generic_in_use = 0;
+
+// generic cache of each request size, in steps of MINALIGN bytes
+static unsigned char generic_index[MAXGENERIC / MINALIGN + 1];
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static __thread cpu_cache_t cpu_cache[MAXCACHES];
+static __thread bool cpu_registered = FALSE;
+static pthread_key_t cpu_key;
+
+/************Function Prototypes******************************************/
+void initSlab();
+int initCache(kma_cache_t*, kma_size_t, kma_size_t, void (*)(void*), int);
+kma_cache_t* genericCache(kma_size_t);
+cpu_cache_t* cpuCache(kma_cache_t*);
+void* slabAlloc(kma_cache_t*);
+void slabFree(kma_cache_t*, void*);
+slab_t* slabOf(void*);
+slab_t* growCache(kma_cache_t*);
+void destroySlab(kma_cache_t*, slab_t*);
+void drainMagazine(kma_cache_t*, magazine_t*);
+void releaseCpuCaches(void*);
+void listPush(slab_t**, slab_t*);
+void listRemove(slab_t**, slab_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page;
+  void* ptr;
+
+  pthread_once(&init_once, initSlab);
+
+  if (size > MAXGENERIC)
+    {
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      ptr = page == NULL ? NULL : page->ptr;
+    }
+  else
+    {
+      ptr = kma_cache_alloc(genericCache(size));
+    }
+
+  if (ptr != NULL)
+    {
+      __atomic_add_fetch(&generic_in_use, 1, __ATOMIC_RELAXED);
+    }
+
+  return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int i;
+
+  if (size > MAXGENERIC)
+    {
+      free_pages(kma_page_from_addr(ptr));
+    }
+  else
+    {
+      kma_cache_free(genericCache(size), ptr);
+    }
+
+  // nothing allocated any more, give the cached memory back
+  if (__atomic_sub_fetch(&generic_in_use, 1, __ATOMIC_RELAXED) == 0)
+    {
+      for (i = 0; i < num_generic; i++)
+	{
+	  kma_cache_reap(&generic[i]);
+	}
+      kma_cache_reap(&magazine_cache);
+    }
+}
+
+kma_cache_t*
+kma_cache_create(kma_size_t size, kma_size_t align, void (*ctor)(void*))
+{
+  kma_cache_t* cache;
+
+  pthread_once(&init_once, initSlab);
+
+  pthread_mutex_lock(&cache_cache.lock);
+  cache = slabAlloc(&cache_cache);
+  pthread_mutex_unlock(&cache_cache.lock);
+  if (cache == NULL)
+    {
+      return NULL;
+    }
+
+  if (!initCache(cache, size, align, ctor, CACHE_OBJECT))
+    {
+      pthread_mutex_lock(&cache_cache.lock);
+      slabFree(&cache_cache, cache);
+      pthread_mutex_unlock(&cache_cache.lock);
+      return NULL;
+    }
+
+  return cache;
+}
+
+void*
+kma_cache_alloc(kma_cache_t* cache)
+{
+  cpu_cache_t* cpu = cpuCache(cache);
+  magazine_t* mag;
+  void* obj;
+
+  if (cache->magsize > 0)
+    {
+      if (cpu->loaded != NULL && cpu->loaded->rounds > 0)
+	{
+	  return cpu->loaded->round[--cpu->loaded->rounds];
+	}
+
+      if (cpu->previous != NULL && cpu->previous->rounds > 0)
+	{
+	  mag = cpu->loaded;
+	  cpu->loaded = cpu->previous;
+	  cpu->previous = mag;
+	  return cpu->loaded->round[--cpu->loaded->rounds];
+	}
+
+      // both empty, exchange one for a full magazine from the depot
+      pthread_mutex_lock(&cache->lock);
+      if (cache->depot_full != NULL)
+	{
+	  mag = cache->depot_full;
+	  cache->depot_full = mag->next;
+	  if (cpu->previous != NULL)
+	    {
+	      cpu->previous->next = cache->depot_empty;
+	      cache->depot_empty = cpu->previous;
+	    }
+	  cpu->previous = cpu->loaded;
+	  cpu->loaded = mag;
+	  pthread_mutex_unlock(&cache->lock);
+	  return mag->round[--mag->rounds];
+	}
+      pthread_mutex_unlock(&cache->lock);
+    }
+
+  pthread_mutex_lock(&cache->lock);
+  obj = slabAlloc(cache);
+  pthread_mutex_unlock(&cache->lock);
+
+  return obj;
+}
+
+void
+kma_cache_free(kma_cache_t* cache, void* obj)
+{
+  cpu_cache_t* cpu = cpuCache(cache);
+  magazine_t* mag;
+
+  if (cache->magsize > 0)
+    {
+      if (cpu->loaded != NULL && cpu->loaded->rounds < cache->magsize)
+	{
+	  cpu->loaded->round[cpu->loaded->rounds++] = obj;
+	  return;
+	}
+
+      if (cpu->previous != NULL && cpu->previous->rounds == 0)
+	{
+	  mag = cpu->loaded;
+	  cpu->loaded = cpu->previous;
+	  cpu->previous = mag;
+	  cpu->loaded->round[cpu->loaded->rounds++] = obj;
+	  return;
+	}
+
+      // both full, exchange one for an empty magazine from the depot or
+      // a new one
+      pthread_mutex_lock(&cache->lock);
+      mag = cache->depot_empty;
+      if (mag != NULL)
+	{
+	  cache->depot_empty = mag->next;
+	}
+      pthread_mutex_unlock(&cache->lock);
+
+      if (mag == NULL)
+	{
+	  pthread_mutex_lock(&magazine_cache.lock);
+	  mag = slabAlloc(&magazine_cache);
+	  pthread_mutex_unlock(&magazine_cache.lock);
+	  if (mag != NULL)
+	    {
+	      mag->rounds = 0;
+	    }
+	}
+
+      if (mag != NULL)
+	{
+	  if (cpu->previous != NULL)
+	    {
+	      pthread_mutex_lock(&cache->lock);
+	      cpu->previous->next = cache->depot_full;
+	      cache->depot_full = cpu->previous;
+	      pthread_mutex_unlock(&cache->lock);
+	    }
+	  cpu->previous = cpu->loaded;
+	  cpu->loaded = mag;
+	  mag->round[mag->rounds++] = obj;
+	  return;
+	}
+    }
+
+  pthread_mutex_lock(&cache->lock);
+  slabFree(cache, obj);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/* Give back the calling thread's magazines, the depot and the empty
+ * slabs. Other threads keep their magazines, they are objects of this
+ * cache still.
+ */
+void
+kma_cache_reap(kma_cache_t* cache)
+{
+  cpu_cache_t* cpu = cpuCache(cache);
+  magazine_t* mag;
+
+  pthread_mutex_lock(&cache->lock);
+
+  if (cache->magsize > 0)
+    {
+      drainMagazine(cache, cpu->loaded);
+      drainMagazine(cache, cpu->previous);
+      cpu->loaded = NULL;
+      cpu->previous = NULL;
+
+      while ((mag = cache->depot_full) != NULL)
+	{
+	  cache->depot_full = mag->next;
+	  drainMagazine(cache, mag);
+	}
+      while ((mag = cache->depot_empty) != NULL)
+	{
+	  cache->depot_empty = mag->next;
+	  drainMagazine(cache, mag);
+	}
+    }
+
+  while (cache->empty != NULL)
+    {
+      destroySlab(cache, cache->empty);
+    }
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void
+kma_cache_destroy(kma_cache_t* cache)
+{
+  kma_cache_reap(cache);
+
+  if (cache->full != NULL || cache->partial != NULL)
+    {
+      error("destroying a cache with allocated objects", "");
+    }
+
+  pthread_mutex_lock(&caches_lock);
+  caches[cache->id] = NULL;
+  pthread_mutex_unlock(&caches_lock);
+
+  pthread_mutex_destroy(&cache->lock);
+
+  pthread_mutex_lock(&cache_cache.lock);
+  slabFree(&cache_cache, cache);
+  pthread_mutex_unlock(&cache_cache.lock);
+
+  // the empty slabs kept for the next cache and its magazines
+  kma_cache_reap(&cache_cache);
+  kma_cache_reap(&magazine_cache);
+}
+
+void
+initSlab()
+{
+  kma_size_t size;
+  int i;
+
+  pthread_key_create(&cpu_key, releaseCpuCaches);
+
+  initCache(&cache_cache, sizeof(kma_cache_t), 0, NULL, CACHE_INTERNAL);
+  initCache(&magazine_cache, sizeof(magazine_t), 0, NULL, CACHE_INTERNAL);
+
+  for (size = MINGENERIC; size <= MAXGENERIC; size *= 2)
+    {
+      initCache(&generic[num_generic++], size, 0, NULL, CACHE_GENERIC);
+      if (size * 3 / 2 < MAXGENERIC && size * 3 / 2 % MINALIGN == 0)
+	{
+	  initCache(&generic[num_generic++], size * 3 / 2, 0, NULL,
+		    CACHE_GENERIC);
+	}
+    }
+  assert(num_generic <= NGENERIC);
+
+  for (i = 0, size = 0; size <= MAXGENERIC; size += MINALIGN)
+    {
+      while (generic[i].size < size)
+	{
+	  i++;
+	}
+      generic_index[size / MINALIGN] = i;
+    }
+}
+
+/* Lay out the slabs of a cache: the stride of its objects and the
+ * number of pages per slab that wastes the least, and register it.
+ */
+int
+initCache(kma_cache_t* cache, kma_size_t size, kma_size_t align,
+	  void (*ctor)(void*), int kind)
+{
+  int pages, best_pages, per_slab, left, best_left;
+
+  memset(cache, 0, sizeof(kma_cache_t));
+
+  if (align < MINALIGN)
+    {
+      align = MINALIGN;
+    }
+  assert((align & (align - 1)) == 0);
+
+  cache->size = size;
+  cache->align = align;
+  cache->ctor = ctor;
+
+  // the free list link must not clobber constructed state, so it goes
+  // behind the object if there is a constructor
+  if (ctor != NULL)
+    {
+      cache->link = ROUNDUP(size, MINALIGN);
+      cache->stride = ROUNDUP(cache->link + sizeof(void*), align);
+    }
+  else
+    {
+      cache->link = 0;
+      cache->stride = ROUNDUP(size < MINALIGN ? MINALIGN : size, align);
+    }
+
+  best_pages = 0;
+  best_left = 0;
+  for (pages = 1; pages <= MAXSLABPAGES; pages++)
+    {
+      per_slab = (pages * PAGESIZE - sizeof(slab_t)) / cache->stride;
+      left = pages * PAGESIZE - sizeof(slab_t) - per_slab * cache->stride;
+      if (per_slab == 0)
+	{
+	  continue;
+	}
+      if (best_pages == 0 || (double) left / pages < (double) best_left
+	  / best_pages)
+	{
+	  best_pages = pages;
+	  best_left = left;
+	}
+      if (left * WASTEFRACTION <= pages * PAGESIZE)
+	{
+	  break;
+	}
+    }
+  if (best_pages == 0)
+    {
+      return FALSE;
+    }
+
+  cache->slab_pages = best_pages;
+  cache->per_slab = (best_pages * PAGESIZE - sizeof(slab_t)) / cache->stride;
+  cache->color_max = best_left;
+  cache->color_next = 0;
+
+  switch (kind)
+    {
+    case CACHE_INTERNAL:
+    case CACHE_GENERIC:
+      cache->magsize = 0;
+      cache->max_empty = 1;
+      break;
+    case CACHE_OBJECT:
+      cache->magsize = MAGSIZE;
+      cache->max_empty = INT_MAX;
+      break;
+    }
+
+  pthread_mutex_init(&cache->lock, NULL);
+
+  pthread_mutex_lock(&caches_lock);
+  for (cache->id = 0; cache->id < MAXCACHES; cache->id++)
+    {
+      if (caches[cache->id] == NULL)
+	{
+	  caches[cache->id] = cache;
+	  cache->generation = ++id_generation[cache->id];
+	  break;
+	}
+    }
+  pthread_mutex_unlock(&caches_lock);
+
+  return cache->id < MAXCACHES;
+}
+
+kma_cache_t*
+genericCache(kma_size_t size)
+{
+  return &generic[generic_index[(size + MINALIGN - 1) / MINALIGN]];
+}
+
+/* The calling thread's magazines of a cache. Magazines a thread still
+ * holds for an earlier, destroyed cache with the same id are dropped: any
+ * rounds in them belong to that cache's freed slabs, so only the
+ * magazines go back to the magazine cache. A thread's first use of any
+ * cache also arranges for its magazines to go back when it exits.
+ */
+cpu_cache_t*
+cpuCache(kma_cache_t* cache)
+{
+  cpu_cache_t* cpu = &cpu_cache[cache->id];
+  magazine_t* mags[2] = { cpu->loaded, cpu->previous };
+  int i;
+
+  if (cpu->generation == cache->generation)
+    {
+      return cpu;
+    }
+
+  if (!cpu_registered)
+    {
+      pthread_setspecific(cpu_key, cpu_cache);
+      cpu_registered = TRUE;
+    }
+
+  pthread_mutex_lock(&magazine_cache.lock);
+  for (i = 0; i < 2; i++)
+    {
+      if (mags[i] != NULL)
+	{
+	  slabFree(&magazine_cache, mags[i]);
+	}
+    }
+  pthread_mutex_unlock(&magazine_cache.lock);
+
+  cpu->loaded = NULL;
+  cpu->previous = NULL;
+  cpu->generation = cache->generation;
+
+  return cpu;
+}
+
+/* Take an object from the slabs, partial slabs first. Called with the
+ * cache lock held.
+ */
+void*
+slabAlloc(kma_cache_t* cache)
+{
+  slab_t* slab = cache->partial;
+  void* obj;
+
+  if (slab == NULL)
+    {
+      slab = cache->empty;
+      if (slab == NULL && (slab = growCache(cache)) == NULL)
+	{
+	  return NULL;
+	}
+      listRemove(&cache->empty, slab);
+      cache->num_empty--;
+      listPush(&cache->partial, slab);
+    }
+
+  obj = slab->free;
+  slab->free = LINK(cache, obj);
+  slab->inuse++;
+
+  if (slab->inuse == cache->per_slab)
+    {
+      listRemove(&cache->partial, slab);
+      listPush(&cache->full, slab);
+    }
+
+  return obj;
+}
+
+/* Return an object to its slab, releasing the slab if it became empty
+ * and the cache keeps enough empty slabs already. Called
+ * with the cache lock held.
+ */
+void
+slabFree(kma_cache_t* cache, void* obj)
+{
+  slab_t* slab = slabOf(obj);
+
+  LINK(cache, obj) = slab->free;
+  slab->free = obj;
+
+  if (slab->inuse == cache->per_slab)
+    {
+      listRemove(&cache->full, slab);
+      listPush(&cache->partial, slab);
+    }
+  slab->inuse--;
+
+  if (slab->inuse == 0)
+    {
+      listRemove(&cache->partial, slab);
+      listPush(&cache->empty, slab);
+      cache->num_empty++;
+      if (cache->num_empty > cache->max_empty)
+	{
+	  destroySlab(cache, slab);
+	}
+    }
+}
+
+/* The slab header at the end of the page or run holding an object.
+ */
+slab_t*
+slabOf(void* obj)
+{
+  kma_page_t* page = kma_page_from_addr(obj);
+
+  return (slab_t*) (page->ptr + page->size - sizeof(slab_t));
+}
+
+/* Create an empty slab. Its objects start at the next color, so the
+ * objects of successive slabs fall onto different cache lines, and are
+ * constructed here once.
+ */
+slab_t*
+growCache(kma_cache_t* cache)
+{
+  kma_page_t* page;
+  slab_t* slab;
+  void* obj;
+  int i;
+
+  page = cache->slab_pages == 1 ? get_page() : get_pages(cache->slab_pages);
+  if (page == NULL)
+    {
+      return NULL;
+    }
+
+  slab = (slab_t*) (page->ptr + page->size - sizeof(slab_t));
+  slab->page = page;
+  slab->inuse = 0;
+  slab->free = NULL;
+
+  obj = page->ptr + cache->color_next
+    + (cache->per_slab - 1) * cache->stride;
+  for (i = 0; i < cache->per_slab; i++, obj -= cache->stride)
+    {
+      if (cache->ctor != NULL)
+	{
+	  cache->ctor(obj);
+	}
+      LINK(cache, obj) = slab->free;
+      slab->free = obj;
+    }
+
+  cache->color_next += cache->align;
+  if (cache->color_next > cache->color_max)
+    {
+      cache->color_next = 0;
+    }
+
+  listPush(&cache->empty, slab);
+  cache->num_empty++;
+
+  return slab;
+}
+
+void
+destroySlab(kma_cache_t* cache, slab_t* slab)
+{
+  listRemove(&cache->empty, slab);
+  cache->num_empty--;
+  free_pages(slab->page);
+}
+
+/* Return the rounds of a magazine to their slabs and the magazine to
+ * the magazine cache. Called with the cache lock held.
+ */
+void
+drainMagazine(kma_cache_t* cache, magazine_t* mag)
+{
+  if (mag == NULL)
+    {
+      return;
+    }
+
+  while (mag->rounds > 0)
+    {
+      slabFree(cache, mag->round[--mag->rounds]);
+    }
+
+  pthread_mutex_lock(&magazine_cache.lock);
+  slabFree(&magazine_cache, mag);
+  pthread_mutex_unlock(&magazine_cache.lock);
+}
+
+/* Thread exit: move the thread's magazines into the depots, and drop
+ * those of destroyed caches.
+ */
+void
+releaseCpuCaches(void* ptr)
+{
+  cpu_cache_t* cpu = (cpu_cache_t*) ptr;
+  magazine_t* mags[2];
+  kma_cache_t* cache;
+  int i, j;
+
+  pthread_mutex_lock(&caches_lock);
+  for (i = 0; i < MAXCACHES; i++)
+    {
+      cache = caches[i];
+      mags[0] = cpu[i].loaded;
+      mags[1] = cpu[i].previous;
+      cpu[i].loaded = NULL;
+      cpu[i].previous = NULL;
+
+      if (cache == NULL || cpu[i].generation != cache->generation)
+	{
+	  // left over from a destroyed cache, not the objects of a cache
+	  pthread_mutex_lock(&magazine_cache.lock);
+	  for (j = 0; j < 2; j++)
+	    {
+	      if (mags[j] != NULL)
+		{
+		  slabFree(&magazine_cache, mags[j]);
+		}
+	    }
+	  pthread_mutex_unlock(&magazine_cache.lock);
+	  continue;
+	}
+
+      pthread_mutex_lock(&cache->lock);
+      for (j = 0; j < 2; j++)
+	{
+	  if (mags[j] == NULL)
+	    {
+	      continue;
+	    }
+	  if (mags[j]->rounds == cache->magsize)
+	    {
+	      mags[j]->next = cache->depot_full;
+	      cache->depot_full = mags[j];
+	    }
+	  else
+	    {
+	      drainMagazine(cache, mags[j]);
+	    }
+	}
+      pthread_mutex_unlock(&cache->lock);
+    }
+  pthread_mutex_unlock(&caches_lock);
+}
+
+void
+listPush(slab_t** list, slab_t* slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    {
+      (*list)->prev = slab;
+    }
+  *list = slab;
+}
+
+void
+listRemove(slab_t** list, slab_t* slab)
+{
+  if (slab->prev != NULL)
+    {
+      slab->prev->next = slab->next;
+    }
+  else
+    {
+      *list = slab->next;
+    }
+  if (slab->next != NULL)
+    {
+      slab->next->prev = slab->prev;
+    }
+}
+
+#endif // KMA_SLAB
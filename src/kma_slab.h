@@ -0,0 +1,100 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface of the object caches of the slab allocator
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the object cache interface
+ *
+ ***************************************************************************/
+
+#ifndef __KSLAB_H__
+#define __KSLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KSLAB_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+typedef struct kma_cache kma_cache_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache of objects of one size; every object is
+ *             constructed once when its slab is created and keeps its
+ *             constructed state across kma_cache_free/kma_cache_alloc
+ *    Input: the object size, the alignment (a power of two, 0 for the
+ *           default) and the constructor (or NULL)
+ *    Output: the cache or NULL if no more caches can be created
+ ***********************************************************************/
+EXTERN kma_cache_t* kma_cache_create(kma_size_t size, kma_size_t align,
+				     void (*ctor)(void*));
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a constructed object from the calling thread's
+ *             magazines, the depot or the slabs of the cache
+ *    Input: the cache
+ *    Output: the object or NULL if out of memory
+ ***********************************************************************/
+EXTERN void* kma_cache_alloc(kma_cache_t*);
+
+/***********************************************************************
+ *  Title: Frees an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns an object, which must be in its constructed
+ *             state again, to the calling thread's magazines
+ *    Input: the cache and the object
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_free(kma_cache_t*, void*);
+
+/***********************************************************************
+ *  Title: Reaps an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Returns the objects in the calling thread's magazines and
+ *             in the depot to their slabs and releases the empty slabs
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_reap(kma_cache_t*);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Reaps the cache and releases it; all objects must have
+ *             been freed and no other thread may use it any more
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_cache_destroy(kma_cache_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KSLAB_H__ */
@@ -0,0 +1,196 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Benchmark for the object caches of the slab allocator
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the slab allocator benchmark
+ *
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// objects held at once and rounds of allocating and freeing them all
+#define OBJECTS 1000
+#define ROUNDS 1000
+
+#define MAGIC 0x5ab5ab
+
+// objects allocated by a thread that frees none of them
+#define TAKEN (OBJECTS / 2)
+
+// a kernel object whose constructor sets up state that survives free
+typedef struct
+{
+  int magic;
+  void* self;
+  char payload[100];
+} object_t;
+
+/************Global Variables*********************************************/
+
+static int num_constructed = 0;
+
+// the objects allocated by the alloc_only thread
+static object_t* taken[TAKEN];
+
+/************Function Prototypes******************************************/
+double now_ns();
+void construct(void*);
+double bench_cache(kma_cache_t*, bool);
+void* alloc_only(void*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  kma_cache_t* cache;
+  void* pin;
+  double typed, generic;
+  pthread_t tid;
+  int i;
+
+  cache = kma_cache_create(sizeof(object_t), 64, construct);
+  if (cache == NULL)
+    {
+      error("unable to create", "object cache");
+    }
+
+  typed = bench_cache(cache, TRUE);
+  printf("object cache:            %10.1f ns/object (%d constructed for %d"
+	 " allocations)\n", typed, num_constructed, OBJECTS * ROUNDS);
+
+  // kma_malloc gives everything back whenever nothing is allocated,
+  // keep something allocated so that does not happen every round
+  pin = kma_malloc(sizeof(object_t));
+  generic = bench_cache(NULL, FALSE);
+  kma_free(pin, sizeof(object_t));
+  printf("kma_malloc:              %10.1f ns/object\n", generic);
+
+  // a thread that only allocates, taking full magazines from the depot,
+  // and exits; its magazines have to find their way back for the cache
+  // to be destroyed with no page left in use
+  pthread_create(&tid, NULL, alloc_only, cache);
+  pthread_join(tid, NULL);
+  for (i = 0; i < TAKEN; i++)
+    {
+      kma_cache_free(cache, taken[i]);
+    }
+
+  kma_cache_destroy(cache);
+
+  if (page_stats()->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+double
+now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void
+construct(void* ptr)
+{
+  object_t* obj = (object_t*) ptr;
+
+  obj->magic = MAGIC;
+  obj->self = obj;
+  num_constructed++;
+}
+
+/* Allocate and free OBJECTS objects ROUNDS times, from the object cache
+ * or through kma_malloc, and check that constructed objects come back
+ * constructed and aligned.
+ */
+double
+bench_cache(kma_cache_t* cache, bool check)
+{
+  static object_t* objs[OBJECTS];
+  double start;
+  int i, j;
+
+  start = now_ns();
+  for (i = 0; i < ROUNDS; i++)
+    {
+      for (j = 0; j < OBJECTS; j++)
+	{
+	  objs[j] = cache != NULL ? kma_cache_alloc(cache)
+	    : kma_malloc(sizeof(object_t));
+	  if (check && (objs[j]->magic != MAGIC || objs[j]->self != objs[j]
+			|| ((long) objs[j] & 63) != 0))
+	    {
+	      error("object not in its constructed state", "");
+	    }
+	}
+      for (j = 0; j < OBJECTS; j++)
+	{
+	  if (cache != NULL)
+	    {
+	      kma_cache_free(cache, objs[j]);
+	    }
+	  else
+	    {
+	      kma_free(objs[j], sizeof(object_t));
+	    }
+	}
+    }
+
+  return (now_ns() - start) / ROUNDS / OBJECTS;
+}
+
+/* Allocate TAKEN objects and exit without freeing any.
+ */
+void*
+alloc_only(void* arg)
+{
+  kma_cache_t* cache = (kma_cache_t*) arg;
+  int i;
+
+  for (i = 0; i < TAKEN; i++)
+    {
+      taken[i] = kma_cache_alloc(cache);
+    }
+
+  return NULL;
+}
@@ -0,0 +1,471 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on spans of pages found
+ *             through a radix tree pagemap
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the span allocator
+ *
+ ***************************************************************************/
+#ifdef KMA_SPAN
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// requests up to MAXSMALL bytes are objects of a size class, larger ones
+// get a span of their own
+#define MAXSMALL 32768
+
+// classes are 16 bytes apart up to 128 bytes, then four per doubling
+#define CLASSSTEP 16
+#define MAXCLASS 64
+
+// a span of a class wastes at most this part of its bytes at the end
+#define MAXTAILWASTE 8
+
+// pagemap: a page number selects a leaf of the root and the entry in it;
+// a leaf is a page from the page layer, taken on first use and given back
+// once it maps no page, and the root is a run with a leaf per LEAFSIZE
+// pages of the pool, taken with the first leaf and given back with the
+// last, so the map costs pages only where spans are
+#define LEAFSIZE (PAGESIZE / sizeof(span_t*))
+
+#define PAGESHIFT __builtin_ctz(PAGESIZE)
+
+typedef struct object
+{
+  struct object* next;
+} object_t;
+
+// a run of pages from the page layer: either cut into objects of one
+// class (class > 0) or a single large allocation (class 0). Spans of a
+// class that have free objects are on its list.
+typedef struct span
+{
+  kma_page_t* page;
+  int npages;
+  int class;
+  int used;
+  // objects are carved from the start of the span up to bump; freed
+  // ones are on free_objects
+  int bump;
+  object_t* free_objects;
+  struct span* next;
+  struct span* prev;
+} span_t;
+
+// a page of span structures; pages with a spare one are on a list
+typedef struct span_page
+{
+  int used;
+  span_t* free_spans;
+  struct span_page* next;
+  struct span_page* prev;
+} span_page_t;
+
+#define SPANSPERPAGE ((PAGESIZE - sizeof(span_page_t)) / sizeof(span_t))
+
+// a leaf of the pagemap and the pages it maps to a span
+typedef struct
+{
+  span_t** spans;
+  int used;
+} leaf_t;
+
+/************Global Variables*********************************************/
+
+// the class of each request size in steps of CLASSSTEP, and the object
+// size and span pages of each class; built on the first request
+static uint8_t class_of[MAXSMALL / CLASSSTEP + 1];
+static int class_size[MAXCLASS];
+static int class_pages[MAXCLASS];
+static int number_class = 0;
+
+// spans with free objects per class
+static span_t* class_spans[MAXCLASS];
+
+// page number to span, for every page of a span in use
+static kma_page_t* root_run = NULL;
+static leaf_t* pagemap;
+static int number_leaf = 0;
+
+// the address of page number 0 of the pool
+static void* pool_base = NULL;
+
+static span_page_t* span_pages = NULL;
+
+/************Function Prototypes******************************************/
+void initClasses();
+span_t* newSpan(int, int);
+void releaseSpan(span_t*);
+span_t* allocSpan();
+void freeSpan(span_t*);
+span_t* getSpan(long);
+void setSpan(span_t*, span_t*);
+void linkSpan(span_t*);
+void unlinkSpan(span_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  span_t* span;
+  object_t* object;
+  int class;
+
+  if (number_class == 0)
+    {
+      initClasses();
+    }
+
+  if (size > MAXSMALL)
+    {
+      span = newSpan(0, (size + PAGESIZE - 1) / PAGESIZE);
+      return span == NULL ? NULL : span->page->ptr;
+    }
+
+  class = class_of[(size + CLASSSTEP - 1) / CLASSSTEP];
+  span = class_spans[class];
+  if (span == NULL)
+    {
+      span = newSpan(class, class_pages[class]);
+      if (span == NULL)
+	{
+	  return NULL;
+	}
+      linkSpan(span);
+    }
+
+  if (span->free_objects != NULL)
+    {
+      object = span->free_objects;
+      span->free_objects = object->next;
+    }
+  else
+    {
+      object = span->page->ptr + span->bump;
+      span->bump += class_size[class];
+    }
+  span->used++;
+
+  // full, off the list until an object is freed
+  if (span->free_objects == NULL
+      && span->bump + class_size[class] > span->npages * PAGESIZE)
+    {
+      unlinkSpan(span);
+    }
+
+  return object;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  span_t* span = getSpan((ptr - pool_base) >> PAGESHIFT);
+  object_t* object = (object_t*) ptr;
+  bool full;
+
+  assert(span != NULL);
+
+  if (span->class == 0)
+    {
+      releaseSpan(span);
+      return;
+    }
+
+  full = span->free_objects == NULL
+    && span->bump + class_size[span->class] > span->npages * PAGESIZE;
+  object->next = span->free_objects;
+  span->free_objects = object;
+  span->used--;
+
+  if (full)
+    {
+      linkSpan(span);
+    }
+
+  // empty spans go straight back, the page layer caches the pages
+  if (span->used == 0)
+    {
+      unlinkSpan(span);
+      releaseSpan(span);
+    }
+}
+
+/* The size classes, as TCMalloc builds them: the object sizes, and per
+ * class the fewest pages that hold at least one object and waste at
+ * most 1/MAXTAILWASTE of the span after the last one.
+ */
+void
+initClasses()
+{
+  int size, step, pages, i = 0, class = 1;
+
+  for (size = CLASSSTEP; size <= MAXSMALL; size += step)
+    {
+      step = size < 128 ? CLASSSTEP : (1 << (31 - __builtin_clz(size))) / 4;
+
+      class_size[class] = size;
+      for (pages = (size + PAGESIZE - 1) / PAGESIZE;
+	   (pages * PAGESIZE) % size > pages * PAGESIZE / MAXTAILWASTE;
+	   pages++)
+	;
+      class_pages[class] = pages;
+
+      for (; i * CLASSSTEP <= size; i++)
+	{
+	  class_of[i] = class;
+	}
+      class++;
+    }
+  assert(class <= MAXCLASS);
+
+  number_class = class;
+}
+
+/* A span of n pages of the class, entered in the pagemap.
+ */
+span_t*
+newSpan(int class, int n)
+{
+  kma_page_t* page;
+  span_t* span;
+
+  page = get_pages(n);
+  if (page == NULL)
+    {
+      return NULL;
+    }
+
+  if (pool_base == NULL)
+    {
+      pool_base = page->ptr - (long) page->id * PAGESIZE;
+    }
+
+  if (root_run == NULL)
+    {
+      // the pages of the pool are known once it handed out one
+      int bytes = (page_stats()->max_pages + LEAFSIZE - 1) / LEAFSIZE
+	* sizeof(leaf_t);
+
+      root_run = get_pages((bytes + PAGESIZE - 1) / PAGESIZE);
+      if (root_run == NULL)
+	{
+	  free_pages(page);
+	  return NULL;
+	}
+      pagemap = root_run->ptr;
+      memset(pagemap, 0, bytes);
+    }
+
+  span = allocSpan();
+  span->page = page;
+  span->npages = n;
+  span->class = class;
+  span->used = 0;
+  span->bump = 0;
+  span->free_objects = NULL;
+  span->next = span->prev = NULL;
+
+  // a large span is only ever looked up by its first page
+  setSpan(span, span);
+
+  return span;
+}
+
+/* Give the pages of a span back, and its structure to its page.
+ */
+void
+releaseSpan(span_t* span)
+{
+  setSpan(span, NULL);
+  free_pages(span->page);
+  freeSpan(span);
+}
+
+/* A span structure from the first page with a spare one, or a new page.
+ */
+span_t*
+allocSpan()
+{
+  span_page_t* sp = span_pages;
+  span_t* span;
+  int i;
+
+  if (sp == NULL)
+    {
+      sp = get_page()->ptr;
+      span = (span_t*) (sp + 1);
+      for (i = 0; i < SPANSPERPAGE - 1; i++)
+	{
+	  span[i].next = &span[i + 1];
+	}
+      span[i].next = NULL;
+      sp->used = 0;
+      sp->free_spans = span;
+      sp->next = sp->prev = NULL;
+      span_pages = sp;
+    }
+
+  span = sp->free_spans;
+  sp->free_spans = span->next;
+  sp->used++;
+
+  // no spare one left, off the list
+  if (sp->free_spans == NULL)
+    {
+      span_pages = sp->next;
+      if (sp->next != NULL)
+	{
+	  sp->next->prev = NULL;
+	}
+    }
+
+  return span;
+}
+
+/* Put a span structure back on its page, giving the page back once none
+ * of its structures is in use.
+ */
+void
+freeSpan(span_t* span)
+{
+  span_page_t* sp = (span_page_t*) BASEADDR(span);
+
+  if (sp->free_spans == NULL)
+    {
+      sp->prev = NULL;
+      sp->next = span_pages;
+      if (span_pages != NULL)
+	{
+	  span_pages->prev = sp;
+	}
+      span_pages = sp;
+    }
+  span->next = sp->free_spans;
+  sp->free_spans = span;
+
+  if (--sp->used == 0)
+    {
+      if (sp->prev != NULL)
+	{
+	  sp->prev->next = sp->next;
+	}
+      else
+	{
+	  span_pages = sp->next;
+	}
+      if (sp->next != NULL)
+	{
+	  sp->next->prev = sp->prev;
+	}
+      free_page(kma_page_from_addr(sp));
+    }
+}
+
+span_t*
+getSpan(long id)
+{
+  span_t** spans = pagemap[id / LEAFSIZE].spans;
+
+  return spans == NULL ? NULL : spans[id % LEAFSIZE];
+}
+
+/* Map the pages of a span to value, only the first one for a large span;
+ * a leaf is brought in for the first page it maps and given back with
+ * the last, and the root with the last leaf.
+ */
+void
+setSpan(span_t* span, span_t* value)
+{
+  leaf_t* leaf;
+  long id = span->page->id;
+  long end = span->class == 0 ? id + 1 : id + span->npages;
+
+  assert(end <= page_stats()->max_pages);
+
+  for (; id < end; id++)
+    {
+      leaf = &pagemap[id / LEAFSIZE];
+      if (value == NULL)
+	{
+	  leaf->spans[id % LEAFSIZE] = NULL;
+	  if (--leaf->used == 0)
+	    {
+	      free_page(kma_page_from_addr(leaf->spans));
+	      leaf->spans = NULL;
+	      if (--number_leaf == 0)
+		{
+		  free_pages(root_run);
+		  root_run = NULL;
+		}
+	    }
+	  continue;
+	}
+
+      if (leaf->used++ == 0)
+	{
+	  leaf->spans = get_page()->ptr;
+	  memset(leaf->spans, 0, PAGESIZE);
+	  number_leaf++;
+	}
+      leaf->spans[id % LEAFSIZE] = value;
+    }
+}
+
+void
+linkSpan(span_t* span)
+{
+  span_t** head = &class_spans[span->class];
+
+  span->prev = NULL;
+  span->next = *head;
+  if (*head != NULL)
+    {
+      (*head)->prev = span;
+    }
+  *head = span;
+}
+
+void
+unlinkSpan(span_t* span)
+{
+  if (span->prev != NULL)
+    {
+      span->prev->next = span->next;
+    }
+  else
+    {
+      class_spans[span->class] = span->next;
+    }
+  if (span->next != NULL)
+    {
+      span->next->prev = span->prev;
+    }
+  span->next = span->prev = NULL;
+}
+
+#endif // KMA_SPAN
@@ -0,0 +1,374 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the two-level segregated
+ *             fit (TLSF) algorithm
+ *    Copyright: 2026 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.1
+ *    - initial version of the TLSF allocator
+ *
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// block sizes are multiples of 8 bytes
+#define ALIGNLOG2 3
+#define ALIGNMENT (1 << ALIGNLOG2)
+
+// every first level range [2^f, 2^(f+1)) is split into 2^SLLOG2 second
+// level lists; below SMALLBLOCK the lists are ALIGNMENT bytes apart
+#define SLLOG2 4
+#define SLCOUNT (1 << SLLOG2)
+#define FLSHIFT (SLLOG2 + ALIGNLOG2)
+#define SMALLBLOCK (1 << FLSHIFT)
+
+// first level 0 holds the small blocks, first level i > 0 the blocks in
+// [2^(i + FLSHIFT - 1), 2^(i + FLSHIFT)); 10 levels cover 64 KB pages
+#define FLCOUNT 10
+
+// the size word of a block carries two flags in its low bits
+#define FREEBIT 0x1
+#define PREVFREEBIT 0x2
+#define FLAGMASK (FREEBIT | PREVFREEBIT)
+
+/* A block as it lies in a page. prev_phys sits in the last word of the
+ * previous block and is only valid while that block is free; size is the
+ * one word of overhead of an allocated block. next_free and prev_free
+ * use the first words of a free block's payload.
+ */
+typedef struct block
+{
+  struct block* prev_phys;
+  kma_size_t size;
+  struct block* next_free;
+  struct block* prev_free;
+} block_t;
+
+// the payload starts after the size word
+#define PAYLOADOFFSET (2 * sizeof(void*))
+// a free block has to hold the free list links and the next block's
+// prev_phys
+#define MINBLOCK (sizeof(block_t) - sizeof(void*))
+
+// a page holds one block from its beginning up to a sentinel, an
+// allocated block of size 0 in the last two words of the page
+#define MAXBLOCK (PAGESIZE - PAYLOADOFFSET - sizeof(void*))
+
+#define BLOCKSIZE(block) ((block)->size & ~FLAGMASK)
+#define PAYLOAD(block) ((void*) (block) + PAYLOADOFFSET)
+#define BLOCKOF(ptr) ((block_t*) ((void*) (ptr) - PAYLOADOFFSET))
+#define NEXTPHYS(block) \
+  ((block_t*) ((void*) (block) + sizeof(void*) + BLOCKSIZE(block)))
+
+/************Global Variables*********************************************/
+
+// a bit per first level with any free block, and per first level a bit
+// per second level list that is not empty
+static unsigned int fl_bitmap = 0;
+static unsigned int sl_bitmap[FLCOUNT];
+static block_t* free_lists[FLCOUNT][SLCOUNT];
+
+static int pages_in_use = 0;
+
+//empty pages kept for reuse instead of being released
+static kma_page_t* spare_pages[SPAREPAGES];
+static int spare_count = 0;
+
+/************Function Prototypes******************************************/
+int flsOf(kma_size_t);
+void mappingInsert(kma_size_t, int*, int*);
+block_t* findBlock(kma_size_t);
+void insertBlock(block_t*);
+void removeBlock(block_t*);
+block_t* newPage();
+void releasePage(block_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  kma_page_t* page;
+  block_t* block;
+  block_t* rest;
+  block_t* next;
+
+  if (size > MAXBLOCK)
+    {
+      // larger than any block, a run of headerless pages
+      page = get_pages((size + PAGESIZE - 1) / PAGESIZE);
+      return page == NULL ? NULL : page->ptr;
+    }
+
+  size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if (size < MINBLOCK)
+    {
+      size = MINBLOCK;
+    }
+
+  block = findBlock(size);
+  if (block == NULL)
+    {
+      // a new page is a single block large enough for any request, even
+      // if its list is not above the one the request rounds up to
+      block = newPage();
+    }
+  else
+    {
+      removeBlock(block);
+    }
+
+  if (BLOCKSIZE(block) >= size + sizeof(void*) + MINBLOCK)
+    {
+      // split, the rest stays free
+      rest = (block_t*) (PAYLOAD(block) + size - sizeof(void*));
+      rest->size = (BLOCKSIZE(block) - size - sizeof(void*)) | FREEBIT;
+      block->size = size | (block->size & PREVFREEBIT);
+      NEXTPHYS(rest)->prev_phys = rest;
+      insertBlock(rest);
+    }
+  else
+    {
+      block->size &= ~FREEBIT;
+      next = NEXTPHYS(block);
+      next->size &= ~PREVFREEBIT;
+    }
+
+  return PAYLOAD(block);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  block_t* block;
+  block_t* prev;
+  block_t* next;
+
+  if (size > MAXBLOCK)
+    {
+      free_pages(kma_page_from_addr(ptr));
+      return;
+    }
+
+  block = BLOCKOF(ptr);
+  assert(!(block->size & FREEBIT));
+
+  // coalesce with the physical neighbours through the boundary tags
+  if (block->size & PREVFREEBIT)
+    {
+      prev = block->prev_phys;
+      removeBlock(prev);
+      prev->size += BLOCKSIZE(block) + sizeof(void*);
+      block = prev;
+    }
+  next = NEXTPHYS(block);
+  if (next->size & FREEBIT)
+    {
+      removeBlock(next);
+      block->size += BLOCKSIZE(next) + sizeof(void*);
+    }
+
+  block->size |= FREEBIT;
+  next = NEXTPHYS(block);
+  next->prev_phys = block;
+  next->size |= PREVFREEBIT;
+
+  if (BLOCKSIZE(block) == MAXBLOCK)
+    {
+      releasePage(block);
+    }
+  else
+    {
+      insertBlock(block);
+    }
+}
+
+/* Index of the most significant bit set.
+ */
+int
+flsOf(kma_size_t size)
+{
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+}
+
+/* The first and second level list of blocks of the size.
+ */
+void
+mappingInsert(kma_size_t size, int* fl, int* sl)
+{
+  int f;
+
+  if (size < SMALLBLOCK)
+    {
+      *fl = 0;
+      *sl = size / (SMALLBLOCK / SLCOUNT);
+    }
+  else
+    {
+      f = flsOf(size);
+      *sl = (size >> (f - SLLOG2)) ^ SLCOUNT;
+      *fl = f - FLSHIFT + 1;
+    }
+}
+
+/* A free block of at least the size from the first list whose blocks
+ * are all large enough, found through the bitmaps in constant time.
+ */
+block_t*
+findBlock(kma_size_t size)
+{
+  unsigned int map;
+  int fl, sl;
+
+  // round up to the next list so any block in it fits
+  if (size >= SMALLBLOCK)
+    {
+      size += (1 << (flsOf(size) - SLLOG2)) - 1;
+    }
+  mappingInsert(size, &fl, &sl);
+  if (fl >= FLCOUNT)
+    {
+      return NULL;
+    }
+
+  map = sl_bitmap[fl] & (~0U << sl);
+  if (map == 0)
+    {
+      // nothing in this first level, take the next one that is not empty
+      map = fl_bitmap & (~0U << (fl + 1));
+      if (map == 0)
+	{
+	  return NULL;
+	}
+      fl = __builtin_ctz(map);
+      map = sl_bitmap[fl];
+    }
+  sl = __builtin_ctz(map);
+
+  return free_lists[fl][sl];
+}
+
+void
+insertBlock(block_t* block)
+{
+  int fl, sl;
+
+  mappingInsert(BLOCKSIZE(block), &fl, &sl);
+  block->prev_free = NULL;
+  block->next_free = free_lists[fl][sl];
+  if (block->next_free != NULL)
+    {
+      block->next_free->prev_free = block;
+    }
+  free_lists[fl][sl] = block;
+
+  fl_bitmap |= 1U << fl;
+  sl_bitmap[fl] |= 1U << sl;
+}
+
+void
+removeBlock(block_t* block)
+{
+  int fl, sl;
+
+  mappingInsert(BLOCKSIZE(block), &fl, &sl);
+  if (block->prev_free != NULL)
+    {
+      block->prev_free->next_free = block->next_free;
+    }
+  else
+    {
+      free_lists[fl][sl] = block->next_free;
+      if (block->next_free == NULL)
+	{
+	  sl_bitmap[fl] &= ~(1U << sl);
+	  if (sl_bitmap[fl] == 0)
+	    {
+	      fl_bitmap &= ~(1U << fl);
+	    }
+	}
+    }
+  if (block->next_free != NULL)
+    {
+      block->next_free->prev_free = block->prev_free;
+    }
+}
+
+/* Format a page as one free block followed by the sentinel.
+ */
+block_t*
+newPage()
+{
+  kma_page_t* page;
+  block_t* block;
+  block_t* sentinel;
+
+  if (spare_count > 0)
+    {
+      page = spare_pages[--spare_count];
+    }
+  else
+    {
+      page = get_page();
+    }
+  pages_in_use++;
+
+  block = (block_t*) page->ptr;
+  block->size = MAXBLOCK | FREEBIT;
+  sentinel = NEXTPHYS(block);
+  sentinel->prev_phys = block;
+  sentinel->size = 0 | PREVFREEBIT;
+
+  return block;
+}
+
+/* Give back a page whose block is free as a whole, keeping a few spares
+ * while other pages are in use.
+ */
+void
+releasePage(block_t* block)
+{
+  assert((void*) block == BASEADDR(block));
+
+  pages_in_use--;
+  if (pages_in_use > 0 && spare_count < SPAREPAGES)
+    {
+      spare_pages[spare_count++] = kma_page_from_addr(block);
+      return;
+    }
+
+  free_page(kma_page_from_addr(block));
+
+  //nothing is allocated anymore, release the spares as well
+  if (pages_in_use == 0)
+    {
+      while (spare_count > 0)
+	{
+	  free_page(spare_pages[--spare_count]);
+	}
+    }
+}
+
+#endif // KMA_TLSF
@@ -65,6 +65,16 @@
 
 typedef int kma_size_t;
 
+#if defined(KMA_BUD) || defined(KMA_LZBUD) || defined(KMA_GBUD)
+// coalescing work done by the buddy allocators
+typedef struct
+{
+  int num_splits;
+  int num_merges;
+  int num_lazy_frees; // frees that skipped coalescing
+} kma_buddy_stat_t;
+#endif
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -91,6 +101,17 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#if defined(KMA_BUD) || defined(KMA_LZBUD) || defined(KMA_GBUD)
+/***********************************************************************
+ *  Title: Buddy allocator statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of block splits and merges so far
+ *    Input: none
+ *    Output: the statistics of the buddy allocator
+ ***********************************************************************/
+EXTERN kma_buddy_stat_t* buddy_stats();
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -62,9 +62,35 @@
 #define EXTERN extern
 #endif
 
+// size of a page; a power of two between 4 KB and 64 KB, overridable
+// at compile time (-DPAGESIZE=n) to build a binary per page size
+#ifndef PAGESIZE
 #define PAGESIZE 8192
+#endif
+
+#if PAGESIZE < 4096 || PAGESIZE > 65536 || (PAGESIZE & (PAGESIZE - 1)) != 0
+#error "PAGESIZE must be a power of two between 4096 and 65536"
+#endif
+
+// default upper bound of the pool in pages; the address space is
+// reserved up front, overridable through the KMA_MAXPAGES environment
+// variable
+#define MAXPAGES 262144
+
+// size of a huge page; the pool is aligned to it
+#define HUGEPAGESIZE (2 * 1024 * 1024)
 
-#define MAXPAGES 4096
+// pages committed at once when the pool grows, one huge page
+#define CHUNKPAGES (HUGEPAGESIZE / PAGESIZE)
+
+// high-water mark of empty pages the pool keeps resident before giving
+// memory back, overridable through the KMA_RETAINPAGES environment
+// variable
+#define RETAINPAGES 256
+
+// empty pages a backend keeps for reuse instead of releasing them
+// while it still has live allocations
+#define SPAREPAGES 4
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -76,6 +102,16 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+// what backs the pool, requested through the KMA_HUGEPAGES environment
+// variable ("thp" or "hugetlb"); explicit huge pages fall back to
+// transparent ones, and those to normal pages, when not available
+enum HUGE_MODE
+  {
+    HUGE_NONE,
+    HUGE_THP,
+    HUGE_HUGETLB
+  };
+
 typedef struct
 {
   int id;
@@ -89,6 +125,36 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  
+  // pool pages made accessible so far, out of max_pages reserved, and
+  // the pages that have been handed out and are still resident
+  int num_committed;
+  int max_pages;
+  int num_touched;
+  
+  // pages served from retained memory vs. fresh pages, and the number
+  // of times retained pages above the high-water mark were given back
+  int num_cache_hits;
+  int num_cache_misses;
+  int num_trimmed;
+  
+  // pages currently resident (handed out at some point and not given
+  // back by the scavenger) and pages given back by it so far
+  int num_resident;
+  int num_scavenged;
+  
+  // the pool backing that actually took effect (enum HUGE_MODE)
+  int huge_mode;
+  
+  // multi-page runs handed out by get_pages (n > 1)
+  int num_runs_requested;
+  int num_runs_freed;
+  int num_runs_in_use;
+  
+  // free extents left in the pool (page-run fragmentation)
+  int num_free_pages;
+  int num_free_runs;
+  int num_coalesced;
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -104,6 +170,30 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a run of contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n pages which are contiguous in memory; the
+ *             run starts on a page boundary and its size is
+ *             n * PAGESIZE. The lowest-addressed free run that fits
+ *             is used.
+ *    Input: the number of pages
+ *    Output: the allocated run or NULL if no free run is large enough
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n);
+
+/***********************************************************************
+ *  Title: Allocates a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates up to n single pages under one lock
+ *             acquisition, address-adjacent when a free run is large
+ *             enough; each page can be released with free_page
+ *    Input: the number of pages and an array for n page structures
+ *    Output: the number of pages stored in the array, fewer than n
+ *            only if the pool is exhausted
+ ***********************************************************************/
+EXTERN int get_pages_batch(int n, kma_page_t* out[]);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
@@ -113,6 +203,50 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Releases a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run returned by get_pages (or a single page);
+ *             the run is merged with adjacent free runs
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/***********************************************************************
+ *  Title: Releases a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n single pages (from get_page or
+ *             get_pages_batch) under one lock acquisition, merging
+ *             them with adjacent free runs
+ *    Input: the number of pages and the array of page structures
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages_batch(int n, kma_page_t* in[]);
+
+/***********************************************************************
+ *  Title: Finds the memory page of an address
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up the page structure of the page or run that
+ *             holds an address, in constant time
+ *    Input: any pointer into an allocated page or run
+ *    Output: the memory page structure or NULL if the pointer is not
+ *            inside the pool
+ ***********************************************************************/
+EXTERN kma_page_t* kma_page_from_addr(void*);
+
+/***********************************************************************
+ *  Title: Gives idle pages back to the system
+ * ---------------------------------------------------------------------
+ *    Purpose: Advances the scavenger clock and releases the memory of
+ *             free runs that have been idle for KMA_SCAVENGE_AGE
+ *             (default 2) calls; with KMA_SCAVENGE_MS set, a
+ *             background thread calls this every KMA_SCAVENGE_MS ms
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void scavenge_pages();
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------